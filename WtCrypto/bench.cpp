@@ -0,0 +1,748 @@
+// bench.cpp -- Micro-benchmarks for the Crypto class.
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/rand.h>
+
+#include "bytepool.h"
+#include "bytesearch.h"
+#include "cipherregistry.h"
+#include "cryptoruntime.h"
+#include "crypto.h"
+#include "hexcodec.h"
+#include "hexdump.h"
+#ifdef WTCRYPTO_BENCH_MODEL
+#include "hexdumpmodel.h"
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+volatile unsigned char sink; // keep results alive
+
+// average wall-clock nanoseconds per call of f()
+template <class F>
+double ns_per_op(const std::size_t iterations, F f)
+{
+	const auto start = Clock::now();
+	for (std::size_t i = 0; i != iterations; ++i)
+		f();
+	const auto stop = Clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / iterations;
+}
+
+// Per-message latency of a fresh, freshly keyed context per call
+// (what every encrypt() used to do) vs. Crypto's cached contexts.
+void bench_context_reuse(const std::string &name, const EVP_CIPHER *cipher,
+	const std::size_t iterations)
+{
+	Crypto crypto(cipher);
+	crypto.newKey();
+	crypto.newIV();
+
+	for (const std::size_t size : { 16, 64, 256, 1024 }) {
+		const Crypto::Bytes plaintext(size, 'x');
+
+		const double fresh = ns_per_op(iterations, [&] {
+			auto enc = crypto.encryptor();
+			Crypto::Bytes ciphertext;
+			enc.begin();
+			enc.update(plaintext, ciphertext);
+			enc.finish(ciphertext);
+			sink = ciphertext[0];
+		});
+
+		const double cached = ns_per_op(iterations, [&] {
+			sink = crypto.encrypt(plaintext)[0];
+		});
+
+		std::cout << std::left << std::setw(18) << name
+			<< std::right << std::setw(6) << size
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(14) << fresh
+			<< std::setw(14) << cached
+			<< std::setprecision(2)
+			<< std::setw(10) << fresh / cached << "x" << std::endl;
+	}
+}
+
+// Throughput of large buffers on the calling thread only vs. split
+// across ThreadPool::instance() (plus the calling thread).
+void bench_parallel(const std::string &name, const EVP_CIPHER *cipher,
+	const bool decrypt, const std::size_t nbytes)
+{
+	Crypto crypto(cipher);
+	crypto.newKey();
+	crypto.newIV();
+
+	Crypto::Bytes input(nbytes, 'x');
+	if (decrypt) {
+		crypto.setThreadPool(nullptr);
+		input = crypto.encrypt(input);
+	}
+	Crypto::Bytes output(crypto.ciphertext_size(input.size()));
+
+	auto run = [&] {
+		if (decrypt)
+			sink = output[crypto.decrypt(input, output) - 1];
+		else
+			sink = output[crypto.encrypt(input, output) - 1];
+	};
+
+	crypto.setThreadPool(nullptr);
+	const double serial = ns_per_op(1, run);
+	crypto.setThreadPool(&ThreadPool::instance());
+	const double parallel = ns_per_op(1, run);
+
+	const double mib = input.size() / (1024.0 * 1024.0);
+	std::cout << std::left << std::setw(18) << name
+		<< std::setw(9) << (decrypt ? "decrypt" : "encrypt")
+		<< std::right << std::fixed << std::setprecision(1)
+		<< std::setw(14) << mib / (serial / 1e9)
+		<< std::setw(14) << mib / (parallel / 1e9)
+		<< std::setprecision(2)
+		<< std::setw(10) << serial / parallel << "x" << std::endl;
+}
+
+// Single-threaded throughput of one cipher, to compare modes.
+void bench_mode(const std::string &name, const std::size_t nbytes)
+{
+	const auto entry = CipherRegistry::instance().find(name);
+	if (entry == nullptr)
+		return; // not available in this OpenSSL
+
+	Crypto crypto(entry->cipher);
+	crypto.setThreadPool(nullptr);
+	crypto.newKey();
+	crypto.newIV();
+
+	const Crypto::Bytes plaintext(nbytes, 'x');
+	Crypto::Bytes ciphertext(crypto.ciphertext_size(plaintext.size()));
+	Crypto::Bytes decrypted(crypto.plaintext_size(ciphertext.size()));
+
+	const double enc = ns_per_op(3, [&] {
+		sink = ciphertext[crypto.encrypt(plaintext, ciphertext) - 1];
+	});
+	const double dec = ns_per_op(3, [&] {
+		sink = decrypted[crypto.decrypt(ciphertext, decrypted) - 1];
+	});
+
+	const double mib = nbytes / (1024.0 * 1024.0);
+	std::cout << std::left << std::setw(24) << name
+		<< std::right << std::fixed << std::setprecision(1)
+		<< std::setw(14) << mib / (enc / 1e9)
+		<< std::setw(14) << mib / (dec / 1e9) << std::endl;
+}
+
+// Many small messages, each with its own IV: one call per message
+// (fresh context each, as Crypto::encrypt() used to do) vs. a batch.
+void bench_batch(const std::string &name, const EVP_CIPHER *cipher,
+	const std::size_t nmessages, const std::size_t size)
+{
+	Crypto crypto(cipher);
+	crypto.newKey();
+
+	Crypto::Batch batch;
+	const Crypto::Bytes data(nmessages * size, 'x');
+	Crypto::Bytes ivs;
+	for (std::size_t i = 0; i != nmessages; ++i) {
+		crypto.newIV();
+		const auto iv = crypto.iv();
+		ivs.insert(ivs.end(), iv.begin(), iv.end());
+	}
+	for (std::size_t i = 0; i <= nmessages; ++i)
+		batch.offsets.push_back(i * size);
+	batch.data = Crypto::ConstSpan(data);
+	batch.ivs = Crypto::ConstSpan(ivs);
+
+	const std::size_t ivlen = ivs.size() / nmessages;
+	const auto key = crypto.key();
+
+	const double single = ns_per_op(1, [&] {
+		for (std::size_t i = 0; i != nmessages; ++i) {
+			const Crypto::Bytes iv(ivs.begin() + i * ivlen, ivs.begin() + (i + 1) * ivlen);
+			const Crypto::Bytes plaintext(data.begin() + i * size, data.begin() + (i + 1) * size);
+			Crypto::Stream enc(cipher, key, iv, Crypto::Stream::ENCRYPT);
+			Crypto::Bytes ciphertext;
+			enc.begin();
+			enc.update(plaintext, ciphertext);
+			enc.finish(ciphertext);
+			sink = ciphertext[0];
+		}
+	});
+
+	Crypto::Bytes out;
+	const double batched = ns_per_op(1, [&] {
+		sink = out[crypto.encrypt_batch(batch, out)[1] - 1];
+	});
+
+	std::cout << std::left << std::setw(18) << name
+		<< std::right << std::setw(6) << size
+		<< std::fixed << std::setprecision(1)
+		<< std::setw(14) << single / nmessages
+		<< std::setw(14) << batched / nmessages
+		<< std::setprecision(2)
+		<< std::setw(10) << single / batched << "x" << std::endl;
+}
+
+// Cost of bringing the ciphertext up to date after a one byte edit
+// near the end (CBC, CFB) or in the middle (ECB, CTR) of a large
+// plaintext: full encryption vs. reencrypt().
+void bench_reencrypt(const std::string &name, const EVP_CIPHER *cipher,
+	const std::size_t nbytes, const std::size_t offset)
+{
+	Crypto crypto(cipher);
+	crypto.newKey();
+	crypto.newIV();
+
+	Crypto::Bytes plaintext(nbytes, 'x');
+	Crypto::Bytes ciphertext(crypto.ciphertext_size(nbytes));
+	ciphertext.resize(crypto.encrypt(plaintext, ciphertext));
+
+	const double full = ns_per_op(3, [&] {
+		++plaintext[offset];
+		sink = ciphertext[crypto.encrypt(plaintext, ciphertext) - 1];
+	});
+	const double patched = ns_per_op(1000, [&] {
+		++plaintext[offset];
+		crypto.reencrypt(plaintext, offset, offset + 1, ciphertext);
+		sink = ciphertext[offset];
+	});
+
+	std::cout << std::left << std::setw(24) << name
+		<< std::right << std::fixed << std::setprecision(1)
+		<< std::setw(14) << full / 1000
+		<< std::setw(14) << patched / 1000
+		<< std::setprecision(0)
+		<< std::setw(10) << full / patched << "x" << std::endl;
+}
+
+// HexDump output rate: line by line (toaddr/tohex/toprint, as the
+// table model uses it) vs. the single-pass dump().
+class LineDump : public HexDump<>
+{
+public:
+	using HexDump<>::HexDump;
+
+	std::string dump_lines(const std::string &input) {
+		return lines_to_string(toaddr(input), tohex(input), toprint(input));
+	}
+};
+
+void bench_hexdump(const unsigned int chars_per_col, const std::size_t nbytes)
+{
+	std::string input(nbytes, '\0');
+	for (std::size_t i = 0; i != nbytes; ++i)
+		input[i] = static_cast<char>(i * 131);
+
+	LineDump dumper(chars_per_col);
+
+	const double lines = ns_per_op(3, [&] {
+		sink = dumper.dump_lines(input).back();
+	});
+	const double single = ns_per_op(3, [&] {
+		sink = dumper.dump(input).back();
+	});
+
+	const double mib = nbytes / (1024.0 * 1024.0);
+	std::cout << std::left << std::setw(24) << chars_per_col
+		<< std::right << std::fixed << std::setprecision(1)
+		<< std::setw(14) << mib / (lines / 1e9)
+		<< std::setw(14) << mib / (single / 1e9)
+		<< std::setprecision(2)
+		<< std::setw(10) << lines / single << "x" << std::endl;
+}
+
+// ---- --suite: every cipher and size, as JSON ----------------------
+
+// Per-call wall-clock time of f(), in ns. Each sample times enough
+// calls to take at least 50 us, so that the clock's resolution
+// doesn't matter, and there are as many samples as fit into budget
+// seconds (at least 3). Calls of a second or more are timed once.
+// Allocations are those of Crypto::Bytes buffers, counted by BytePool:
+// all of them would be a malloc without the pool, heap_allocs still are.
+struct Timing {
+	std::size_t calls = 0;   // per sample
+	std::size_t samples = 0;
+	double min = 0;
+	double median = 0;
+	double p99 = 0;
+	double allocs = 0;       // per call
+	double heap_allocs = 0;  // per call
+};
+
+template <class F>
+Timing measure(F f, const double budget = 0.25)
+{
+	const BytePool::Stats before = BytePool::stats();
+	std::size_t total = 0;
+	auto time = [&](const std::size_t calls) {
+		total += calls;
+		const auto start = Clock::now();
+		for (std::size_t i = 0; i != calls; ++i)
+			f();
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+	};
+
+	Timing timing;
+	std::vector<double> samples;
+	const double first = time(1); // also warms up caches and contexts
+	if (first >= 1e9)
+		samples.push_back(first);
+	else {
+		const double once = std::max(time(1), 1.0);
+		timing.calls = once >= 50e3 ? 1 : static_cast<std::size_t>(50e3 / once) + 1;
+		const double n = budget * 1e9 / (once * timing.calls);
+		const std::size_t nsamples = n < 3 ? 3 : n > 1000 ? 1000 : static_cast<std::size_t>(n);
+		for (std::size_t i = 0; i != nsamples; ++i)
+			samples.push_back(time(timing.calls));
+	}
+	if (timing.calls == 0)
+		timing.calls = 1;
+
+	std::sort(samples.begin(), samples.end());
+	timing.samples = samples.size();
+	timing.min = samples.front();
+	timing.median = samples[samples.size() / 2];
+	timing.p99 = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+
+	const BytePool::Stats &after = BytePool::stats();
+	timing.allocs = static_cast<double>(after.allocations - before.allocations) / total;
+	timing.heap_allocs = static_cast<double>(after.heap - before.heap) / total;
+	return timing;
+}
+
+// one line of the JSON output
+struct Result {
+	std::string group; // crypto, hexdump, codec, random, pool, search, model
+	std::string name;  // cipher or function
+	std::string op;
+	std::size_t bytes;
+	Timing timing;
+	std::string error; // instead of timing
+};
+
+std::string json_string(const std::string &in)
+{
+	std::ostringstream out;
+	out << '"';
+	for (const char c : in) {
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (static_cast<unsigned char>(c) < 0x20)
+			out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+		else
+			out << c;
+	}
+	out << '"';
+	return out.str();
+}
+
+// Flat, one result per line, so that runs can be diffed and joined
+// on (group, name, op, bytes).
+void write_json(std::ostream &out, const std::vector<Result> &results)
+{
+	out << "{\n"
+		<< "  \"benchmark\": \"wtcrypto-bench\",\n"
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		<< "  \"openssl\": " << json_string(OpenSSL_version(OPENSSL_VERSION)) << ",\n"
+#else
+		<< "  \"openssl\": " << json_string(SSLeay_version(SSLEAY_VERSION)) << ",\n"
+#endif
+		<< "  \"hexcodec\": " << json_string(HexCodec::name(HexCodec::best())) << ",\n"
+		<< "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+		<< "  \"results\": [";
+
+	out << std::setprecision(6);
+	for (std::size_t i = 0; i != results.size(); ++i) {
+		const Result &r = results[i];
+		out << (i == 0 ? "\n" : ",\n") << "    { \"group\": " << json_string(r.group)
+			<< ", \"name\": " << json_string(r.name)
+			<< ", \"op\": " << json_string(r.op)
+			<< ", \"bytes\": " << r.bytes;
+		if (!r.error.empty())
+			out << ", \"error\": " << json_string(r.error);
+		else {
+			out << ", \"calls\": " << r.timing.calls
+				<< ", \"samples\": " << r.timing.samples
+				<< ", \"ns_min\": " << r.timing.min
+				<< ", \"ns_median\": " << r.timing.median
+				<< ", \"ns_p99\": " << r.timing.p99
+				<< ", \"mb_per_s\": " << (r.bytes == 0 ? 0 : r.bytes * 1e3 / r.timing.median)
+				<< ", \"allocs\": " << r.timing.allocs
+				<< ", \"heap_allocs\": " << r.timing.heap_allocs;
+		}
+		out << " }";
+	}
+	out << "\n  ]\n}\n";
+}
+
+class Suite {
+public:
+	Suite(const std::size_t max_bytes, const std::string &filter) :
+		max_bytes_(max_bytes),
+		filter_(filter) {}
+
+	const std::vector<Result> &results() const { return results_; }
+
+	// encrypt() and decrypt() of every cipher, single-threaded, into
+	// preallocated buffers, 16 B to 256 MB
+	void crypto() {
+		for (const auto &entry : CipherRegistry::instance().entries()) {
+			if (entry.name.find(filter_) == std::string::npos)
+				continue;
+
+			Crypto crypto(entry.cipher);
+			crypto.setThreadPool(nullptr);
+			crypto.newKey();
+			crypto.newIV();
+
+			for (const std::size_t size : sizes(16, std::size_t(256) << 20, 16)) {
+				Crypto::Bytes plaintext(size);
+				fill(plaintext);
+				Crypto::Bytes ciphertext(crypto.ciphertext_size(size));
+				Crypto::Bytes decrypted(size + EVP_MAX_BLOCK_LENGTH);
+
+				run("crypto", entry.name, "encrypt", size, [&] {
+					ciphertext.resize(crypto.ciphertext_size(size));
+					ciphertext.resize(crypto.encrypt(plaintext, ciphertext));
+					sink = ciphertext.back();
+				});
+				if (ciphertext.empty())
+					continue; // encryption failed
+				run("crypto", entry.name, "decrypt", size, [&] {
+					sink = decrypted[crypto.decrypt(ciphertext, decrypted) - 1];
+				});
+			}
+		}
+	}
+
+	void hexdump() {
+		HexDump<> dumper;
+		for (const std::size_t size : sizes(16, std::size_t(16) << 20, 16)) {
+			std::string input(size, '\0');
+			fill(input);
+			const auto hexlines = dumper.tohex(input);
+			std::string out(dumper.dump_size(size), '\0');
+
+			run("hexdump", "HexDump::dump(string)", "format", size, [&] {
+				sink = dumper.dump(input).back();
+			});
+			run("hexdump", "HexDump::dump(bytes, out)", "format", size, [&] {
+				sink = out[dumper.dump(reinterpret_cast<const unsigned char *>(input.data()), size, &out[0]) - 1];
+			});
+			run("hexdump", "HexDump::tohex", "format", size, [&] {
+				sink = dumper.tohex(input).back().back();
+			});
+			run("hexdump", "HexDump::fromhexlines", "parse", size, [&] {
+				sink = dumper.fromhexlines(hexlines).back();
+			});
+		}
+	}
+
+	void codec() {
+		for (const std::size_t size : sizes(16, std::size_t(16) << 20, 16)) {
+			Crypto::Bytes bytes(size);
+			fill(bytes);
+			const std::string str = Crypto::toString(bytes);
+			const std::string hex = HexCodec::encode(bytes);
+
+			run("codec", "Crypto::hexToBytes", "parse", size, [&] {
+				sink = Crypto::hexToBytes(hex).back();
+			});
+			run("codec", "HexCodec::encode", "format", size, [&] {
+				sink = HexCodec::encode(bytes).back();
+			});
+			run("codec", "Crypto::toBytes", "convert", size, [&] {
+				sink = Crypto::toBytes(str).back();
+			});
+			run("codec", "Crypto::toString", "convert", size, [&] {
+				sink = Crypto::toString(bytes).back();
+			});
+		}
+	}
+
+	// a fresh key and IV, straight from the DRBG and from RandomPool,
+	// one pair at a time and a thousand at once
+	void random() {
+		const EVP_CIPHER *cipher = EVP_aes_256_cbc();
+		const std::size_t keylen = static_cast<std::size_t>(EVP_CIPHER_key_length(cipher));
+		const std::size_t ivlen = static_cast<std::size_t>(EVP_CIPHER_iv_length(cipher));
+		Crypto crypto(cipher);
+		unsigned char key[EVP_MAX_KEY_LENGTH], iv[EVP_MAX_IV_LENGTH];
+
+		run("random", "RAND_bytes", "key+iv", keylen + ivlen, [&] {
+			if (RAND_bytes(key, static_cast<int>(keylen)) != 1 || RAND_bytes(iv, static_cast<int>(ivlen)) != 1)
+				throw std::runtime_error("RAND_bytes failed");
+			sink = key[0] ^ iv[0];
+		});
+		run("random", "Crypto::newKey+newIV", "key+iv", keylen + ivlen, [&] {
+			crypto.newKey();
+			crypto.newIV();
+			sink = crypto.key()[0] ^ crypto.iv()[0];
+		});
+		run("random", "Crypto::newKeyIVs", "1000 key+iv", 1000 * (keylen + ivlen), [&] {
+			sink = Crypto::newKeyIVs(cipher, 1000).ivs.back();
+		});
+	}
+
+	// a buffer's allocation and release, from the heap and from
+	// BytePool, which also wipes it
+	void pool() {
+		for (const std::size_t size : sizes(16, std::size_t(16) << 20, 16)) {
+			run("pool", "std::vector<unsigned char>", "alloc+free", size, [&] {
+				std::vector<unsigned char> buffer(size);
+				sink = buffer.front();
+			});
+			run("pool", "Crypto::Bytes", "alloc+free", size, [&] {
+				Crypto::Bytes buffer(size);
+				sink = buffer.front();
+			});
+		}
+	}
+
+	// a pattern that isn't there, i.e. a scan of the whole buffer, by
+	// each ByteSearch kernel and by std::search
+	void search() {
+		const std::string needle = "needle in the haystack";
+		const auto *pattern = reinterpret_cast<const unsigned char *>(needle.data());
+		for (const std::size_t size : sizes(16, std::size_t(256) << 20, 16)) {
+			Crypto::Bytes hay(size);
+			fill(hay);
+
+			for (const auto kernel : { HexCodec::Kernel::Scalar, HexCodec::Kernel::SSSE3, HexCodec::Kernel::AVX2 }) {
+				if (kernel > HexCodec::best())
+					continue;
+				const ByteSearch searcher(pattern, needle.size(), kernel);
+				run("search", std::string("ByteSearch::find/") + HexCodec::name(kernel), "find", size, [&] {
+					sink = searcher.find(hay.data(), size) == ByteSearch::npos;
+				});
+			}
+			run("search", "std::search", "find", size, [&] {
+				sink = std::search(hay.begin(), hay.end(), needle.begin(), needle.end()) == hay.end();
+			});
+		}
+	}
+
+#ifdef WTCRYPTO_BENCH_MODEL
+	// rescan() plus what a view asks for right after it: one screen
+	// of rows
+	void model() {
+		const auto ed_model = std::make_shared<EncDecModel>();
+		HexDumpTableModel hd_model(ed_model);
+		for (const std::size_t size : sizes(16, std::size_t(256) << 20, 16)) {
+			Crypto::Bytes bytes(size);
+			fill(bytes);
+
+			run("model", "HexDumpTableModel::rescan", "rescan", size, [&] {
+				hd_model.rescan(bytes);
+			});
+			run("model", "HexDumpTableModel::rescan", "rescan+40 rows", size, [&] {
+				hd_model.rescan(bytes);
+				const int rows = std::min(hd_model.rowCount(), 40);
+				for (int row = 0; row != rows; ++row)
+					for (int col = 0; col != 3; ++col)
+						sink = Wt::asString(hd_model.data(hd_model.index(row, col))).empty();
+			});
+		}
+	}
+#endif
+
+private:
+	// from, from * factor, ... up to max_bytes_
+	std::vector<std::size_t> sizes(const std::size_t from, const std::size_t to, const std::size_t factor) const {
+		std::vector<std::size_t> result;
+		for (std::size_t size = from; size <= to && size <= max_bytes_; size *= factor)
+			result.push_back(size);
+		return result;
+	}
+
+	template <class Buffer>
+	static void fill(Buffer &buffer) {
+		for (std::size_t i = 0; i != buffer.size(); ++i)
+			buffer[i] = static_cast<typename Buffer::value_type>(i * 131 + (i >> 8));
+	}
+
+	template <class F>
+	void run(const std::string &group, const std::string &name, const std::string &op,
+		const std::size_t bytes, F f) {
+		Result result{ group, name, op, bytes, Timing(), std::string() };
+		try {
+			result.timing = measure(f);
+		}
+		catch (std::exception &e) {
+			result.error = e.what(); // e.g. XTS beyond its maximum data unit
+		}
+		std::cerr << std::left << std::setw(8) << group << std::setw(28) << name
+			<< std::setw(16) << op << std::right << std::setw(10) << bytes;
+		if (result.error.empty())
+			std::cerr << std::fixed << std::setprecision(1)
+				<< std::setw(14) << result.timing.median << " ns"
+				<< std::setw(12) << bytes * 1e3 / result.timing.median << " MB/s"
+				<< std::setw(8) << result.timing.allocs << " / " << result.timing.heap_allocs << " allocs" << std::endl;
+		else
+			std::cerr << "  error: " << result.error << std::endl;
+		results_.push_back(result);
+	}
+
+	const std::size_t max_bytes_;
+	const std::string filter_;
+	std::vector<Result> results_;
+};
+
+int suite(int argc, char **argv)
+{
+	std::string json = "-";
+	std::size_t max_bytes = std::size_t(256) << 20;
+	std::string filter;
+	for (int i = 2; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (i + 1 == argc) {
+			std::cerr << "wtcrypto-bench: " << arg << " needs a value" << std::endl;
+			return 2;
+		}
+		if (arg == "--json")
+			json = argv[++i];
+		else if (arg == "--max-size")
+			max_bytes = std::stoull(argv[++i]);
+		else if (arg == "--cipher")
+			filter = argv[++i];
+		else {
+			std::cerr << "wtcrypto-bench: unknown option " << arg << std::endl;
+			return 2;
+		}
+	}
+
+	Suite suite(max_bytes, filter);
+	suite.crypto();
+	suite.hexdump();
+	suite.codec();
+	suite.random();
+	suite.pool();
+	suite.search();
+#ifdef WTCRYPTO_BENCH_MODEL
+	suite.model();
+#endif
+
+	if (json == "-")
+		write_json(std::cout, suite.results());
+	else {
+		std::ofstream out(json);
+		write_json(out, suite.results());
+		if (!out) {
+			std::cerr << "wtcrypto-bench: can't write " << json << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	CryptoRuntime crypto_runtime;
+
+	if (argc > 1 && std::string(argv[1]) == "--suite")
+		return suite(argc, argv);
+
+	const std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 100000;
+	const std::size_t megabytes = argc > 2 ? std::stoul(argv[2]) : 100;
+
+	std::cout << std::left << std::setw(18) << "cipher"
+		<< std::right << std::setw(6) << "bytes"
+		<< std::setw(14) << "fresh ns/msg"
+		<< std::setw(14) << "cached ns/msg"
+		<< std::setw(11) << "speedup" << std::endl;
+
+	bench_context_reuse("EVP_aes_128_cbc", EVP_aes_128_cbc(), iterations);
+	bench_context_reuse("EVP_aes_256_cbc", EVP_aes_256_cbc(), iterations);
+	bench_context_reuse("EVP_aes_256_ecb", EVP_aes_256_ecb(), iterations);
+
+	std::cout << std::endl
+		<< std::left << std::setw(18) << "cipher"
+		<< std::right << std::setw(6) << "bytes"
+		<< std::setw(14) << "single ns/msg"
+		<< std::setw(14) << "batch ns/msg"
+		<< std::setw(11) << "speedup" << std::endl;
+
+	for (const std::size_t size : { 16, 64, 256, 1024 }) {
+		bench_batch("EVP_aes_128_cbc", EVP_aes_128_cbc(), 10000, size);
+		bench_batch("EVP_aes_128_gcm", EVP_aes_128_gcm(), 10000, size);
+	}
+
+	std::cout << std::endl
+		<< std::left << std::setw(24) << "cipher"
+		<< std::right << std::setw(14) << "encrypt MB/s"
+		<< std::setw(14) << "decrypt MB/s" << std::endl;
+
+	for (const auto &name : { "EVP_aes_128_cbc", "EVP_aes_128_ctr", "EVP_aes_128_gcm",
+		"EVP_aes_128_xts", "EVP_aes_256_cbc", "EVP_aes_256_ctr", "EVP_aes_256_gcm",
+		"EVP_aes_256_xts", "EVP_chacha20_poly1305" }) {
+		bench_mode(name, 16u << 20);
+	}
+
+	std::cout << std::endl
+		<< std::left << std::setw(24) << "cipher (1 byte edited)"
+		<< std::right << std::setw(14) << "full us"
+		<< std::setw(14) << "patch us"
+		<< std::setw(11) << "speedup" << std::endl;
+
+	const std::size_t doc = 16u << 20;
+	bench_reencrypt("EVP_aes_128_cbc", EVP_aes_128_cbc(), doc, doc - 100);
+	bench_reencrypt("EVP_des_cfb", EVP_des_cfb(), doc, doc - 100);
+	bench_reencrypt("EVP_aes_128_ecb", EVP_aes_128_ecb(), doc, doc / 2);
+	bench_reencrypt("EVP_aes_128_ctr", EVP_aes_128_ctr(), doc, doc / 2);
+
+	std::cout << std::endl
+		<< std::left << std::setw(24) << "hexdump chars_per_col"
+		<< std::right << std::setw(14) << "lines MB/s"
+		<< std::setw(14) << "dump MB/s"
+		<< std::setw(11) << "speedup" << std::endl;
+
+	for (const unsigned int chars_per_col : { 4, 6, 8, 16 })
+		bench_hexdump(chars_per_col, 16u << 20);
+
+	std::cout << std::endl
+		<< std::left << std::setw(27) << "cipher"
+		<< std::right << std::setw(14) << "1 thread MB/s"
+		<< std::setw(14) << "parallel MB/s"
+		<< std::setw(11) << "speedup"
+		<< "   (" << ThreadPool::instance().size() + 1 << " threads)" << std::endl;
+
+	const std::size_t nbytes = megabytes * 1000 * 1000;
+	bench_parallel("EVP_aes_256_ecb", EVP_aes_256_ecb(), false, nbytes);
+	bench_parallel("EVP_aes_256_ecb", EVP_aes_256_ecb(), true, nbytes);
+	bench_parallel("EVP_aes_256_cbc", EVP_aes_256_cbc(), true, nbytes);
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+// bytepool.h -- Recycled, wiped buffers for Crypto::Bytes
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include <openssl/crypto.h>
+
+/*
+* Buffers for Crypto::Bytes, in power-of-two size classes from 64 B
+* to 64 KB. Freed buffers are wiped, and kept by the freeing thread for
+* its next allocations of that class, up to CACHE_BYTES per class: no
+* malloc, and no contention with other threads, in the steady state.
+* A thread keeps at most CLASSES * CACHE_BYTES (704 KB) that way.
+* Larger buffers, and those beyond the cache, are wiped and handed back
+* to the heap.
+*
+* Wiping covers whatever the buffers held: keys, IVs, plaintexts.
+*/
+class BytePool
+{
+public:
+	constexpr static std::size_t MIN_SHIFT = 6;  // 64 B
+	constexpr static std::size_t MAX_SHIFT = 16; // 64 KB, CACHE_BYTES
+	constexpr static std::size_t CLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+	constexpr static std::size_t CACHE_BYTES = 64 * 1024; // per class and thread
+
+	// the calling thread's allocations so far
+	struct Stats {
+		std::uint64_t allocations = 0; // all requests
+		std::uint64_t reused = 0;      // served from the cache
+		std::uint64_t heap = 0;        // served by operator new
+	};
+
+	static const Stats &stats() { return thread_stats(); }
+
+	static_assert((std::size_t(1) << MAX_SHIFT) <= CACHE_BYTES, "classes have to fit the cache");
+
+	static void *allocate(const std::size_t n) {
+		Stats &stats = thread_stats();
+		++stats.allocations;
+		const std::size_t c = size_class(n);
+		if (c < CLASSES && !dead()) {
+			Cache &cache = thread_cache();
+			if (Block *b = cache.free[c]) {
+				cache.free[c] = b->next;
+				--cache.count[c];
+				b->next = nullptr; // the rest was wiped on the way in
+				++stats.reused;
+				return b;
+			}
+		}
+		++stats.heap;
+		return ::operator new(c < CLASSES ? class_size(c) : n);
+	}
+
+	static void deallocate(void *p, const std::size_t n) {
+		const std::size_t c = size_class(n);
+		OPENSSL_cleanse(p, n); // only n bytes were ever handed out
+		if (c < CLASSES && !dead()) {
+			Cache &cache = thread_cache();
+			if (cache.count[c] < capacity(c)) {
+				Block *b = static_cast<Block *>(p);
+				b->next = cache.free[c];
+				cache.free[c] = b;
+				++cache.count[c];
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+
+private:
+	struct Block {
+		Block *next;
+	};
+
+	struct Cache {
+		Block *free[CLASSES] = {};
+		std::size_t count[CLASSES] = {};
+
+		~Cache() {
+			dead() = true;
+			for (std::size_t c = 0; c < CLASSES; ++c)
+				while (Block *b = free[c]) {
+					free[c] = b->next;
+					::operator delete(b);
+				}
+		}
+	};
+
+	// index of the smallest class that holds n bytes; CLASSES if none
+	static std::size_t size_class(const std::size_t n) {
+		std::size_t c = 0;
+		while (c < CLASSES && class_size(c) < n)
+			++c;
+		return c;
+	}
+
+	static std::size_t class_size(const std::size_t c) {
+		return std::size_t(1) << (c + MIN_SHIFT);
+	}
+
+	// no class is larger than CACHE_BYTES: one buffer, at least
+	static std::size_t capacity(const std::size_t c) {
+		return CACHE_BYTES / class_size(c);
+	}
+
+	static Cache &thread_cache() {
+		static thread_local Cache cache;
+		return cache;
+	}
+
+	// The thread's cache is gone: objects destroyed after it, e.g.
+	// statics of the main thread, go straight to the heap.
+	static bool &dead() {
+		static thread_local bool dead = false;
+		return dead;
+	}
+
+	static Stats &thread_stats() {
+		static thread_local Stats stats;
+		return stats;
+	}
+};
+
+// Standard allocator on BytePool
+template <class T>
+class PoolAllocator
+{
+public:
+	using value_type = T;
+	using propagate_on_container_move_assignment = std::true_type;
+	using is_always_equal = std::true_type;
+
+	PoolAllocator() = default;
+	template <class U>
+	PoolAllocator(const PoolAllocator<U> &) {}
+
+	T *allocate(const std::size_t n) {
+		return static_cast<T *>(BytePool::allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, const std::size_t n) {
+		BytePool::deallocate(p, n * sizeof(T));
+	}
+
+	template <class U>
+	bool operator==(const PoolAllocator<U> &) const { return true; }
+	template <class U>
+	bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+using PooledBytes = std::vector<unsigned char, PoolAllocator<unsigned char>>;
@@ -0,0 +1,296 @@
+// bytesearch.h -- Find byte patterns in large buffers
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "hexcodec.h"
+
+/*
+* Finds a byte pattern in a buffer, memmem()-style, or enumerates all
+* its (possibly overlapping) occurrences.
+*
+* Blocks of 32 (AVX2) or 16 (SSE2) positions are filtered at once by
+* comparing the bytes under the pattern's first and last byte, and
+* only the candidates left are compared in full. Where too many of
+* those turn out false (e.g. a pattern of zeros in a zeroed buffer),
+* and without SIMD, the rest is searched with the Two-Way algorithm,
+* which never takes more than linear time.
+*/
+class ByteSearch
+{
+public:
+	static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+	// an empty pattern: never found
+	ByteSearch() = default;
+
+	ByteSearch(const unsigned char *pattern, const std::size_t m,
+		const HexCodec::Kernel kernel = HexCodec::best()) :
+		pattern_(pattern, pattern + m),
+		kernel_(kernel) {
+		if (m >= 2)
+			factorize();
+	}
+
+	template <class Container>
+	explicit ByteSearch(const Container &pattern) :
+		ByteSearch(reinterpret_cast<const unsigned char *>(pattern.data()), pattern.size()) {}
+
+	std::size_t size() const { return pattern_.size(); }
+	bool empty() const { return pattern_.empty(); }
+
+	// the first match at or after from in hay[0, n), or npos
+	std::size_t find(const unsigned char *hay, const std::size_t n, const std::size_t from = 0) const {
+		std::size_t at = npos;
+		scan(hay, n, from, [&](const std::size_t i) { at = i; return false; });
+		return at;
+	}
+
+	// Call f(offset) for each match at or after from in hay[0, n), in
+	// order, until it returns false. Returns the number of calls.
+	template <class F>
+	std::size_t find_all(const unsigned char *hay, const std::size_t n, const std::size_t from, F f) const {
+		return scan(hay, n, from, f);
+	}
+
+	std::size_t count(const unsigned char *hay, const std::size_t n) const {
+		return scan(hay, n, 0, [](std::size_t) { return true; });
+	}
+
+private:
+	struct State {
+		std::size_t count = 0;
+		std::size_t candidates = 0;
+		bool stopped = false;
+	};
+
+	template <class F>
+	std::size_t scan(const unsigned char *hay, const std::size_t n, std::size_t i, F &&f) const {
+		const std::size_t m = pattern_.size();
+		State state;
+		if (m == 0 || n < m || i > n - m)
+			return 0;
+
+		if (m == 1) {
+			const void *p;
+			while (i < n && (p = std::memchr(hay + i, pattern_[0], n - i)) != nullptr) {
+				i = static_cast<std::size_t>(static_cast<const unsigned char *>(p) - hay);
+				++state.count;
+				if (!f(i))
+					break;
+				++i;
+			}
+			return state.count;
+		}
+
+#ifdef HEXCODEC_X86
+		if (kernel_ == HexCodec::Kernel::AVX2)
+			i = filter_avx2(hay, n, i, f, state);
+		else if (kernel_ == HexCodec::Kernel::SSSE3)
+			i = filter_sse2(hay, n, i, f, state);
+#endif
+		if (!state.stopped)
+			two_way(hay, n, i, f, state);
+		return state.count;
+	}
+
+	// Whether the filter still pays off after the positions [start, i):
+	// about one false candidate per 16 positions is where comparing
+	// them one by one gets slower than Two-Way.
+	static bool filtering(const State &state, const std::size_t start, const std::size_t i) {
+		return state.candidates <= 64 + (i - start) / 16;
+	}
+
+	static unsigned lowest(const unsigned mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+		unsigned long bit;
+		_BitScanForward(&bit, mask);
+		return static_cast<unsigned>(bit);
+#else
+		return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+	}
+
+	// compare the candidates in mask (bit k: position i + k) in full
+	template <class F>
+	bool verify(const unsigned char *hay, const std::size_t i, unsigned mask, F &f, State &state) const {
+		const std::size_t m = pattern_.size();
+		for (; mask != 0; mask &= mask - 1) {
+			const std::size_t at = i + lowest(mask);
+			++state.candidates;
+			if (std::memcmp(hay + at + 1, pattern_.data() + 1, m - 2) == 0) {
+				++state.count;
+				if (!f(at)) {
+					state.stopped = true;
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+#ifdef HEXCODEC_X86
+	// Filter positions from i on, while whole blocks fit; returns the
+	// first position not looked at.
+	template <class F>
+	HEXCODEC_TARGET("sse2")
+	std::size_t filter_sse2(const unsigned char *hay, const std::size_t n, std::size_t i, F &f, State &state) const {
+		const std::size_t m = pattern_.size();
+		const __m128i first = _mm_set1_epi8(static_cast<char>(pattern_[0]));
+		const __m128i last = _mm_set1_epi8(static_cast<char>(pattern_[m - 1]));
+		const std::size_t start = i;
+		while (i + m - 1 + 16 <= n && filtering(state, start, i)) {
+			const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hay + i));
+			const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hay + i + m - 1));
+			const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+				_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+			if (mask != 0 && !verify(hay, i, mask, f, state))
+				break;
+			i += 16;
+		}
+		return i;
+	}
+
+	template <class F>
+	HEXCODEC_TARGET("avx2")
+	std::size_t filter_avx2(const unsigned char *hay, const std::size_t n, std::size_t i, F &f, State &state) const {
+		const std::size_t m = pattern_.size();
+		const __m256i first = _mm256_set1_epi8(static_cast<char>(pattern_[0]));
+		const __m256i last = _mm256_set1_epi8(static_cast<char>(pattern_[m - 1]));
+		const std::size_t start = i;
+		while (i + m - 1 + 32 <= n && filtering(state, start, i)) {
+			const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i));
+			const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i + m - 1));
+			const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+				_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+			if (mask != 0 && !verify(hay, i, mask, f, state))
+				break;
+			i += 32;
+		}
+		return i;
+	}
+#endif
+
+	// The maximal suffix of the pattern, by byte order or reverse byte
+	// order, and its period: returns the suffix's start - 1 (npos for
+	// the whole pattern).
+	std::size_t max_suffix(const bool reverse, std::size_t &period) const {
+		const std::size_t m = pattern_.size();
+		std::size_t ms = npos, j = 0, k = 1;
+		period = 1;
+		while (j + k < m) {
+			const unsigned char a = pattern_[j + k];
+			const unsigned char b = pattern_[ms + k]; // wraps around for npos
+			if (reverse ? a > b : a < b) {
+				j += k;
+				k = 1;
+				period = j - ms;
+			}
+			else if (a == b) {
+				if (k != period)
+					++k;
+				else {
+					j += period;
+					k = 1;
+				}
+			}
+			else {
+				ms = j++;
+				k = period = 1;
+			}
+		}
+		return ms;
+	}
+
+	// Two-Way preprocessing: the critical factorization of the pattern
+	// into pattern_[0, split_) and pattern_[split_, m), and the shift
+	// after a full match.
+	void factorize() {
+		const std::size_t m = pattern_.size();
+		std::size_t p, prev;
+		const std::size_t ms = max_suffix(false, p);
+		const std::size_t msrev = max_suffix(true, prev);
+		if (ms + 1 < msrev + 1) {
+			split_ = msrev + 1;
+			period_ = prev;
+		}
+		else {
+			split_ = ms + 1;
+			period_ = p;
+		}
+		periodic_ = std::memcmp(pattern_.data(), pattern_.data() + period_, split_) == 0;
+		if (!periodic_)
+			period_ = std::max(split_, m - split_) + 1;
+	}
+
+	// Crochemore and Perrin's Two-Way algorithm, from position j on:
+	// compare the right half first, left to right, then the left half,
+	// right to left. For periodic patterns, the prefix known to match
+	// after a shift by the period is not compared again.
+	template <class F>
+	void two_way(const unsigned char *hay, const std::size_t n, std::size_t j, F &f, State &state) const {
+		const unsigned char *x = pattern_.data();
+		const std::size_t m = pattern_.size();
+		std::size_t memory = 0;
+		while (j + m <= n) {
+			if (memory == 0) {
+				// skip to where the right half's first byte is (memchr is fast)
+				const void *p = std::memchr(hay + j + split_, x[split_], n - m - j + 1);
+				if (p == nullptr)
+					return;
+				j = static_cast<std::size_t>(static_cast<const unsigned char *>(p) - hay) - split_;
+			}
+			std::size_t i = periodic_ ? std::max(split_, memory) : split_;
+			while (i < m && x[i] == hay[j + i])
+				++i;
+			if (i < m) {
+				j += i - split_ + 1;
+				memory = 0;
+				continue;
+			}
+
+			const std::size_t low = periodic_ ? memory : 0;
+			i = split_;
+			while (i > low && x[i - 1] == hay[j + i - 1])
+				--i;
+			if (i <= low) { // memory may cover the whole left half
+				++state.count;
+				if (!f(j)) {
+					state.stopped = true;
+					return;
+				}
+			}
+			j += period_;
+			memory = periodic_ ? m - period_ : 0;
+		}
+	}
+
+	std::vector<unsigned char> pattern_;
+	HexCodec::Kernel kernel_ = HexCodec::Kernel::Scalar;
+	std::size_t split_ = 0;   // Two-Way: start of the right half
+	std::size_t period_ = 1;  // Two-Way: shift after a match
+	bool periodic_ = false;
+};
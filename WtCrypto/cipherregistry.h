@@ -0,0 +1,184 @@
+// cipherregistry.h -- The ciphers on offer, and what there is to know about them
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include "crypto.h"
+
+/*
+* Every cipher on offer, with its parameters worked out once. Built on
+* first use and never changed after that, so that all sessions and
+* threads share the one instance, without locks and without copies.
+*/
+class CipherRegistry
+{
+public:
+	struct Entry {
+		std::string name;        // e.g. "EVP_aes_128_cbc"
+		const EVP_CIPHER *cipher;
+		std::size_t block_size;  // 1 for stream ciphers and modes
+		std::size_t key_length;
+		std::size_t iv_length;
+		std::size_t tag_length;  // 0 unless AEAD
+		int mode;                // EVP_CIPH_*_MODE
+		const char *mode_name;   // e.g. "CBC"
+		bool aead;
+		bool parallel_encrypt;   // see Crypto::parallelizable()
+		bool parallel_decrypt;
+	};
+
+	static const CipherRegistry &instance() {
+		static const CipherRegistry registry;
+		return registry;
+	}
+
+	// sorted by name
+	const std::vector<Entry> &entries() const { return entries_; }
+
+	// nullptr if there's no such cipher
+	const Entry *find(const std::string &name) const {
+		const auto it = index_.find(name);
+		return it != index_.end() ? &entries_[it->second] : nullptr;
+	}
+
+	const Entry &at(const std::string &name) const {
+		const Entry *entry = find(name);
+		if (entry == nullptr)
+			throw std::runtime_error("Unknown cipher " + name);
+		return *entry;
+	}
+
+	CipherRegistry(const CipherRegistry &) = delete;
+	CipherRegistry &operator=(const CipherRegistry &) = delete;
+
+private:
+	CipherRegistry() {
+		const struct {
+			const char *name;
+			const EVP_CIPHER *cipher;
+		} ciphers[] = {
+		{ "EVP_aes_128_cbc",      EVP_aes_128_cbc() },
+		{ "EVP_aes_128_ctr",      EVP_aes_128_ctr() },
+		{ "EVP_aes_128_ecb",      EVP_aes_128_ecb() },
+		{ "EVP_aes_128_gcm",      EVP_aes_128_gcm() },
+		{ "EVP_aes_128_xts",      EVP_aes_128_xts() },
+		{ "EVP_aes_192_cbc",      EVP_aes_192_cbc() },
+		{ "EVP_aes_192_ctr",      EVP_aes_192_ctr() },
+		{ "EVP_aes_192_ecb",      EVP_aes_192_ecb() },
+		{ "EVP_aes_192_gcm",      EVP_aes_192_gcm() },
+		{ "EVP_aes_256_cbc",      EVP_aes_256_cbc() },
+		{ "EVP_aes_256_ctr",      EVP_aes_256_ctr() },
+		{ "EVP_aes_256_ecb",      EVP_aes_256_ecb() },
+		{ "EVP_aes_256_gcm",      EVP_aes_256_gcm() },
+		{ "EVP_aes_256_xts",      EVP_aes_256_xts() },
+		{ "EVP_bf_cbc",           EVP_bf_cbc() },
+		{ "EVP_bf_cfb",           EVP_bf_cfb() },
+		{ "EVP_bf_ecb",           EVP_bf_ecb() },
+		{ "EVP_bf_ofb",           EVP_bf_ofb() },
+		{ "EVP_camellia_128_cbc", EVP_camellia_128_cbc() },
+		{ "EVP_camellia_128_ecb", EVP_camellia_128_ecb() },
+		{ "EVP_camellia_192_cbc", EVP_camellia_192_cbc() },
+		{ "EVP_camellia_256_ecb", EVP_camellia_256_ecb() },
+		{ "EVP_cast5_cbc",        EVP_cast5_cbc() },
+		{ "EVP_cast5_cfb",        EVP_cast5_cfb() },
+		{ "EVP_cast5_ecb",        EVP_cast5_ecb() },
+		{ "EVP_cast5_ofb",        EVP_cast5_ofb() },
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA)
+		{ "EVP_chacha20_poly1305", EVP_chacha20_poly1305() },
+#endif
+		{ "EVP_des_cbc",          EVP_des_cbc() },
+		{ "EVP_des_cfb",          EVP_des_cfb() },
+		{ "EVP_des_ecb",          EVP_des_ecb() },
+		{ "EVP_des_ofb",          EVP_des_ofb() },
+		{ "EVP_des_ede_cbc",      EVP_des_ede_cbc() },
+		{ "EVP_des_ede_cfb",      EVP_des_ede_cfb() },
+		{ "EVP_des_ede_ofb",      EVP_des_ede_ofb() },
+		{ "EVP_des_ede3_cbc",     EVP_des_ede3_cbc() },
+		{ "EVP_des_ede3_cfb",     EVP_des_ede3_cfb() },
+		{ "EVP_des_ede3_ofb",     EVP_des_ede3_ofb() },
+		// { "EVP_idea_cbc",         EVP_idea_cbc() },
+		// { "EVP_idea_cfb",         EVP_idea_cfb() },
+		// { "EVP_idea_ecb",         EVP_idea_ecb() },
+		// { "EVP_idea_ofb",         EVP_idea_ofb() },
+		};
+
+		for (const auto &c : ciphers)
+			entries_.push_back(entry(c.name, c.cipher));
+		std::sort(entries_.begin(), entries_.end(), [](const Entry &a, const Entry &b) {
+			return a.name < b.name;
+		});
+
+		index_.reserve(entries_.size());
+		for (std::size_t i = 0; i < entries_.size(); ++i)
+			index_.emplace(entries_[i].name, i);
+	}
+
+	static Entry entry(const char *name, const EVP_CIPHER *cipher) {
+		Entry e;
+		e.name = name;
+		e.cipher = cipher;
+		e.block_size = static_cast<std::size_t>(EVP_CIPHER_block_size(cipher));
+		e.key_length = static_cast<std::size_t>(EVP_CIPHER_key_length(cipher));
+		e.iv_length = static_cast<std::size_t>(EVP_CIPHER_iv_length(cipher));
+		e.aead = Crypto::isAEAD(cipher);
+		e.tag_length = 0;
+		if (e.aead)
+			e.tag_length = Crypto::AEAD_TAG_LENGTH;
+		e.mode = static_cast<int>(EVP_CIPHER_mode(cipher));
+		e.mode_name = mode_name(e.mode);
+		e.parallel_encrypt = Crypto::parallelizable(cipher, Crypto::Stream::ENCRYPT);
+		e.parallel_decrypt = Crypto::parallelizable(cipher, Crypto::Stream::DECRYPT);
+		return e;
+	}
+
+	static const char *mode_name(const int mode) {
+		switch (mode) {
+		case EVP_CIPH_ECB_MODE:
+			return "ECB";
+		case EVP_CIPH_CBC_MODE:
+			return "CBC";
+		case EVP_CIPH_CFB_MODE:
+			return "CFB";
+		case EVP_CIPH_OFB_MODE:
+			return "OFB";
+		case EVP_CIPH_CTR_MODE:
+			return "CTR";
+		case EVP_CIPH_GCM_MODE:
+			return "GCM";
+		case EVP_CIPH_XTS_MODE:
+			return "XTS";
+		default:
+			return "stream";
+		}
+	}
+
+	std::vector<Entry> entries_;
+	std::unordered_map<std::string, std::size_t> index_; // name -> entries_
+};
@@ -0,0 +1,628 @@
+// cli.cpp -- Encrypt, decrypt and hexdump files from the command line
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "cipherregistry.h"
+#include "cryptoruntime.h"
+#include "crypto.h"
+#include "filecryptor.h"
+#include "hexcodec.h"
+#include "hexdump.h"
+
+namespace {
+
+const char USAGE[] =
+	"usage: wtcrypto-cli -e|-d|-x [options] INPUT OUTPUT\n"
+	"       wtcrypto-cli -l\n"
+	"\n"
+	"  -e, --encrypt        encrypt INPUT into OUTPUT\n"
+	"  -d, --decrypt        decrypt INPUT into OUTPUT\n"
+	"  -x, --hexdump        hexdump INPUT into OUTPUT\n"
+	"  -l, --list           list the ciphers\n"
+	"  -c, --cipher NAME    cipher (default EVP_aes_256_ctr)\n"
+	"  -k, --key HEX        key; when encrypting without one, a new key\n"
+	"  -i, --iv HEX         and iv are made up and printed to stderr\n"
+	"  -t, --threads N      worker threads (default: one per hardware thread);\n"
+	"                       only ECB, CTR and CBC / CFB decryption use more than one\n"
+	"      --chunk KB       bytes per piece of work (default 4096)\n"
+	"      --direct         write OUTPUT with O_DIRECT, past the page cache\n"
+	"  -v, --verbose        print throughput to stderr\n"
+	"\n"
+	"OUTPUT may be - for stdout. INPUT is memory-mapped where possible.\n"
+	"XTS ciphers take at most 16 MiB: the whole input is one data unit.\n";
+
+struct Options {
+	enum Mode { NONE, ENCRYPT, DECRYPT, HEXDUMP, LIST };
+
+	Mode mode = NONE;
+	std::string cipher = "EVP_aes_256_ctr";
+	std::string key; // hex
+	std::string iv;  // hex
+	std::size_t threads = 0; // one per hardware thread
+	std::size_t chunk = 4u << 20;
+	bool direct = false;
+	bool verbose = false;
+	std::string input;
+	std::string output;
+};
+
+Options parse(const int argc, char **argv)
+{
+	Options options;
+	std::vector<std::string> files;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 == argc)
+				throw std::invalid_argument(arg + " needs a value");
+			return argv[++i];
+		};
+		auto mode = [&](const Options::Mode m) {
+			if (options.mode != Options::NONE)
+				throw std::invalid_argument("Only one of -e, -d, -x and -l");
+			options.mode = m;
+		};
+
+		if (arg == "-e" || arg == "--encrypt")
+			mode(Options::ENCRYPT);
+		else if (arg == "-d" || arg == "--decrypt")
+			mode(Options::DECRYPT);
+		else if (arg == "-x" || arg == "--hexdump")
+			mode(Options::HEXDUMP);
+		else if (arg == "-l" || arg == "--list")
+			mode(Options::LIST);
+		else if (arg == "-c" || arg == "--cipher")
+			options.cipher = value();
+		else if (arg == "-k" || arg == "--key")
+			options.key = value();
+		else if (arg == "-i" || arg == "--iv")
+			options.iv = value();
+		else if (arg == "-t" || arg == "--threads")
+			options.threads = std::stoul(value());
+		else if (arg == "--chunk")
+			options.chunk = std::stoul(value()) << 10;
+		else if (arg == "--direct")
+			options.direct = true;
+		else if (arg == "-v" || arg == "--verbose")
+			options.verbose = true;
+		else if (arg == "-h" || arg == "--help") {
+			std::cout << USAGE;
+			std::exit(0);
+		}
+		else if (arg.size() > 1 && arg[0] == '-')
+			throw std::invalid_argument("Unknown option " + arg);
+		else
+			files.push_back(arg);
+	}
+
+	if (options.mode == Options::NONE)
+		throw std::invalid_argument("One of -e, -d, -x or -l is needed");
+	if (options.mode != Options::LIST) {
+		if (files.size() != 2)
+			throw std::invalid_argument("INPUT and OUTPUT are needed");
+		options.input = files[0];
+		options.output = files[1];
+	}
+	if (options.threads == 0)
+		options.threads = std::max(1u, std::thread::hardware_concurrency());
+	if (options.chunk == 0)
+		throw std::invalid_argument("--chunk must not be 0");
+	return options;
+}
+
+/*
+* Where the results go: a file or stdout. With O_DIRECT, only whole,
+* aligned blocks may be written; they are collected in an aligned
+* buffer first, and the tail is written the ordinary way at the end.
+*/
+class Output
+{
+public:
+	constexpr static std::size_t ALIGN = 4096;
+	constexpr static std::size_t STAGING = 4u << 20; // a multiple of ALIGN
+
+	Output(const std::string &path, const bool direct) :
+		path_(path),
+		staging_(nullptr, &std::free) {
+#if !defined(_WIN32)
+		if (path == "-") {
+			fd_ = STDOUT_FILENO;
+			return;
+		}
+		const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+		void *buffer = nullptr;
+		if (direct && posix_memalign(&buffer, ALIGN, STAGING) == 0) {
+			staging_.reset(static_cast<unsigned char *>(buffer));
+			fd_ = ::open(path.c_str(), flags | O_DIRECT, 0644);
+			if (fd_ < 0) {
+				std::cerr << "wtcrypto-cli: " << path << ": no O_DIRECT here, writing through the page cache\n";
+				staging_.reset();
+			}
+		}
+#else
+		if (direct)
+			std::cerr << "wtcrypto-cli: no O_DIRECT here, writing through the page cache\n";
+#endif
+		if (fd_ < 0)
+			fd_ = ::open(path.c_str(), flags, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("Can't create " + path + ": " + std::strerror(errno));
+#else
+		(void)direct;
+		file_ = path == "-" ? stdout : std::fopen(path.c_str(), "wb");
+		if (file_ == nullptr)
+			throw std::runtime_error("Can't create " + path);
+#endif
+	}
+
+	~Output() {
+		try {
+			close();
+		}
+		catch (...) {
+			// only reached when already unwinding from another error
+		}
+	}
+
+	Output(const Output &) = delete;
+	Output &operator=(const Output &) = delete;
+
+	void write(const unsigned char *data, std::size_t n) {
+		written_ += n;
+		if (staging_ == nullptr) {
+			write_out(data, n);
+			return;
+		}
+		while (n != 0) {
+			const std::size_t take = std::min(n, STAGING - staged_);
+			std::memcpy(staging_.get() + staged_, data, take);
+			staged_ += take;
+			data += take;
+			n -= take;
+			if (staged_ == STAGING) {
+				write_out(staging_.get(), STAGING);
+				staged_ = 0;
+			}
+		}
+	}
+
+	void close() {
+#if !defined(_WIN32)
+		if (fd_ < 0)
+			return;
+		if (staging_ != nullptr) {
+			const std::size_t aligned = staged_ / ALIGN * ALIGN;
+			write_out(staging_.get(), aligned);
+#ifdef O_DIRECT
+			fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+#endif
+			write_out(staging_.get() + aligned, staged_ - aligned);
+			staged_ = 0;
+		}
+		const int fd = fd_;
+		fd_ = -1;
+		if (fd != STDOUT_FILENO && ::close(fd) != 0)
+			throw std::runtime_error("Can't write " + path_ + ": " + std::strerror(errno));
+#else
+		if (file_ == nullptr)
+			return;
+		std::FILE *file = file_;
+		file_ = nullptr;
+		if ((file == stdout ? std::fflush(file) : std::fclose(file)) != 0)
+			throw std::runtime_error("Can't write " + path_);
+#endif
+	}
+
+	// after errors: don't leave half an output behind
+	void remove() {
+		try {
+			close();
+		}
+		catch (...) {
+		}
+		if (path_ != "-")
+			std::remove(path_.c_str());
+	}
+
+	std::uint64_t written() const { return written_; }
+	bool direct() const { return staging_ != nullptr; }
+
+private:
+	void write_out(const unsigned char *data, std::size_t n) {
+#if !defined(_WIN32)
+		while (n != 0) {
+			const ssize_t w = ::write(fd_, data, n);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error("Can't write " + path_ + ": " + std::strerror(errno));
+			}
+			data += w;
+			n -= static_cast<std::size_t>(w);
+		}
+#else
+		if (n != 0 && std::fwrite(data, 1, n, file_) != n)
+			throw std::runtime_error("Can't write " + path_);
+#endif
+	}
+
+	const std::string path_;
+#if !defined(_WIN32)
+	int fd_ = -1;
+#else
+	std::FILE *file_ = nullptr;
+#endif
+	std::unique_ptr<unsigned char, decltype(&std::free)> staging_; // O_DIRECT only
+	std::size_t staged_ = 0;
+	std::uint64_t written_ = 0;
+};
+
+/*
+* reader -> workers -> writer, over a ring of slots, two per worker:
+* while a worker is busy with one piece of the input, the reader gets
+* the next one in (or has the kernel read ahead, for mapped files), and
+* the writer puts out earlier results, in order. work() runs on the
+* worker threads; with one worker, it sees the pieces in order.
+*/
+class Pipeline
+{
+public:
+	// worker, piece of input, its offset, is it the last piece,
+	// the ivlen (or fewer) input bytes before it; returns bytes written
+	// to out, which work() sizes as needed
+	using Work = std::function<std::size_t(std::size_t worker, Crypto::ConstSpan in,
+		std::uint64_t offset, bool last, Crypto::ConstSpan before, Crypto::Bytes &out)>;
+
+	Pipeline(InputFile &input, const std::uint64_t size, const std::size_t chunk,
+		const std::size_t workers, Output &output) :
+		input_(input),
+		size_(size),
+		chunk_(chunk),
+		pieces_(size == 0 ? 1 : (size + chunk - 1) / chunk), // an empty input is one (empty) piece
+		workers_(workers),
+		slots_(2 * workers + 2),
+		output_(output) {}
+
+	void run(const Work &work) {
+		std::vector<std::thread> threads;
+		threads.emplace_back([&] { guard([&] { read(); }); });
+		for (std::size_t w = 0; w != workers_; ++w)
+			threads.emplace_back([&, w] { guard([&] { process(w, work); }); });
+		guard([&] { write(); });
+		for (auto &thread : threads)
+			thread.join();
+		if (error_)
+			std::rethrow_exception(error_);
+	}
+
+private:
+	struct Slot {
+		enum State { FREE, READ, BUSY, DONE };
+
+		State state = FREE;
+		std::uint64_t index = 0;
+		Crypto::ConstSpan in{ nullptr, 0 };
+		Crypto::Bytes copy;   // of in, for unmapped input
+		Crypto::Bytes before; // the input bytes before in
+		Crypto::Bytes out;
+		std::size_t out_len = 0;
+	};
+
+	// first error wins, and stops everybody
+	template <class F>
+	void guard(F f) {
+		try {
+			f();
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!error_)
+				error_ = std::current_exception();
+			cv_.notify_all();
+		}
+	}
+
+	// wait until slot k is in state, or somebody failed
+	Slot &wait(const std::uint64_t k, const Slot::State state, std::unique_lock<std::mutex> &lock) {
+		Slot &slot = slots_[k % slots_.size()];
+		cv_.wait(lock, [&] { return error_ || (slot.state == state && (state == Slot::FREE || slot.index == k)); });
+		if (error_)
+			throw Stop();
+		return slot;
+	}
+
+	void set(Slot &slot, const Slot::State state) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		slot.state = state;
+		cv_.notify_all();
+	}
+
+	struct Stop {}; // somebody else failed
+
+	void read() {
+		Crypto::Bytes tail; // of the previous piece
+		for (std::uint64_t k = 0; k != pieces_; ++k) {
+			Slot *slot;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				slot = &wait(k, Slot::FREE, lock);
+			}
+			const std::uint64_t offset = k * chunk_;
+			const std::size_t len = static_cast<std::size_t>(std::min<std::uint64_t>(chunk_, size_ - offset));
+
+			slot->index = k;
+			slot->before = tail;
+			if (input_.mapped()) {
+				input_.prefetch(offset, len);
+				slot->in = input_.at(offset, len);
+			}
+			else {
+				const Crypto::ConstSpan in = input_.at(offset, len);
+				slot->copy.assign(in.begin(), in.end());
+				slot->in = Crypto::ConstSpan(slot->copy);
+			}
+			const std::size_t keep = std::min<std::size_t>(len, EVP_MAX_IV_LENGTH);
+			tail.assign(slot->in.end() - keep, slot->in.end());
+			set(*slot, Slot::READ);
+		}
+	}
+
+	void process(const std::size_t worker, const Work &work) {
+		for (;;) {
+			Slot *slot;
+			std::uint64_t k;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				if (next_ == pieces_)
+					return;
+				k = next_++;
+				slot = &wait(k, Slot::READ, lock);
+				slot->state = Slot::BUSY;
+			}
+			slot->out_len = work(worker, slot->in, k * chunk_, k + 1 == pieces_,
+				Crypto::ConstSpan(slot->before), slot->out);
+			set(*slot, Slot::DONE);
+		}
+	}
+
+	void write() {
+		for (std::uint64_t k = 0; k != pieces_; ++k) {
+			Slot *slot;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				slot = &wait(k, Slot::DONE, lock);
+			}
+			output_.write(slot->out.data(), slot->out_len);
+			set(*slot, Slot::FREE);
+		}
+	}
+
+	InputFile &input_;
+	const std::uint64_t size_;
+	const std::size_t chunk_;
+	const std::uint64_t pieces_;
+	const std::size_t workers_;
+	std::vector<Slot> slots_;
+	Output &output_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::uint64_t next_ = 0; // next piece for the workers
+	std::exception_ptr error_;
+};
+
+const EVP_CIPHER *find_cipher(const std::string &name)
+{
+	const auto entry = CipherRegistry::instance().find(name);
+	if (entry == nullptr)
+		throw std::invalid_argument("Unknown cipher " + name + " (see -l)");
+	return entry->cipher;
+}
+
+Crypto::Bytes hex_arg(const std::string &hex, const std::size_t length, const char *what)
+{
+	const Crypto::Bytes bytes = HexCodec::decode<Crypto::Bytes>(hex);
+	if (bytes.size() != length)
+		throw std::invalid_argument(std::string(what) + " must be " + std::to_string(length) + " bytes");
+	return bytes;
+}
+
+// Encrypt / decrypt: pieces are a multiple of the cipher's unit, and
+// independent of each other in parallelizable modes, where every worker
+// starts its own stream at each of its pieces. Otherwise, one worker
+// carries a single stream through all pieces in order.
+std::size_t crypt(const Options &options, InputFile &input, Output &output)
+{
+	const EVP_CIPHER *cipher = find_cipher(options.cipher);
+	const Crypto::Stream::Direction dir = options.mode == Options::ENCRYPT ?
+		Crypto::Stream::ENCRYPT : Crypto::Stream::DECRYPT;
+
+	Crypto crypto(cipher);
+	Crypto::Bytes key, iv;
+	if (options.key.empty() && options.iv.empty() && dir == Crypto::Stream::ENCRYPT) {
+		crypto.newKey();
+		crypto.newIV();
+		key = crypto.key();
+		iv = crypto.iv();
+		std::cerr << "key " << HexCodec::encode(key) << "\niv  " << HexCodec::encode(iv) << std::endl;
+	}
+	else {
+		key = hex_arg(options.key, EVP_CIPHER_key_length(cipher), "Key");
+		iv = hex_arg(options.iv, EVP_CIPHER_iv_length(cipher), "IV");
+	}
+
+	// AEAD: when decrypting, the tag is the end of the input
+	const std::size_t taglen = crypto.tag_length();
+	std::uint64_t size = input.size();
+	Crypto::Bytes tag;
+	if (dir == Crypto::Stream::DECRYPT && taglen != 0) {
+		if (size < taglen)
+			throw std::runtime_error("Ciphertext shorter than authentication tag");
+		size -= taglen;
+		const Crypto::ConstSpan t = input.at(size, taglen);
+		tag.assign(t.begin(), t.end());
+	}
+
+	const bool xts = EVP_CIPHER_mode(cipher) == EVP_CIPH_XTS_MODE;
+	const bool parallel = Crypto::parallelizable(cipher, dir) && options.threads > 1;
+	const std::size_t unit = Crypto::parallel_unit(cipher);
+	std::size_t chunk = std::max(options.chunk / unit * unit, unit);
+	if (xts) // XTS can't be fed piecemeal: one piece of at most Crypto::XTS_MAX
+		chunk = std::max<std::size_t>(static_cast<std::size_t>(size), 1);
+	const std::size_t workers = parallel ? options.threads : 1;
+
+	std::vector<std::unique_ptr<Crypto::Stream>> streams(workers);
+	bool started = false;
+
+	Pipeline pipeline(input, size, chunk, workers, output);
+	pipeline.run([&](const std::size_t worker, const Crypto::ConstSpan in, const std::uint64_t offset,
+		const bool last, const Crypto::ConstSpan before, Crypto::Bytes &out) {
+		auto &stream = streams[worker];
+		if (stream == nullptr)
+			stream.reset(new Crypto::Stream(cipher, key, iv, dir));
+
+		if (parallel) {
+			const Crypto::Bytes start = Crypto::iv_at(cipher, iv, static_cast<std::size_t>(offset), before);
+			stream->begin(Crypto::ConstSpan(start));
+			stream->set_padding(last);
+		}
+		else if (!started) {
+			stream->begin();
+			if (!tag.empty())
+				stream->set_tag(Crypto::ConstSpan(tag));
+			started = true;
+		}
+
+		if (out.size() < in.size() + EVP_MAX_BLOCK_LENGTH + taglen)
+			out.resize(in.size() + EVP_MAX_BLOCK_LENGTH + taglen);
+		std::size_t outl = stream->update(in, Crypto::Span(out));
+		if (parallel && !last)
+			return outl + stream->finish(Crypto::Span(out).subspan(outl));
+		if (!last)
+			return outl;
+
+		outl += stream->finish(Crypto::Span(out).subspan(outl)); // checks the tag
+		if (dir == Crypto::Stream::ENCRYPT && taglen != 0) {
+			stream->get_tag(Crypto::Span(out.data() + outl, taglen));
+			outl += taglen;
+		}
+		return outl;
+	});
+	return workers;
+}
+
+// Hexdump: pieces are whole lines, and always independent.
+std::size_t hexdump(const Options &options, InputFile &input, Output &output)
+{
+	const HexDump<> dumper;
+	const std::size_t bpl = dumper.bytes_per_line();
+	const std::size_t chunk = std::max(options.chunk / bpl * bpl, bpl);
+
+	Pipeline pipeline(input, input.size(), chunk, options.threads, output);
+	pipeline.run([&](std::size_t, const Crypto::ConstSpan in, const std::uint64_t offset,
+		bool, Crypto::ConstSpan, Crypto::Bytes &out) {
+		const std::size_t base = static_cast<std::size_t>(offset);
+		out.resize(dumper.dump_size(in.size(), base));
+		return dumper.dump(in.data(), in.size(), reinterpret_cast<char *>(out.data()), base);
+	});
+	return options.threads;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	CryptoRuntime crypto_runtime;
+
+	Options options;
+	try {
+		options = parse(argc, argv);
+	}
+	catch (std::exception &e) {
+		std::cerr << "wtcrypto-cli: " << e.what() << "\n\n" << USAGE;
+		return 2;
+	}
+
+	if (options.mode == Options::LIST) {
+		for (const auto &entry : CipherRegistry::instance().entries())
+			std::cout << std::left << std::setw(24) << entry.name << std::setw(8) << entry.mode_name
+				<< "key " << std::setw(4) << entry.key_length << "iv " << std::setw(4) << entry.iv_length
+				<< (entry.parallel_encrypt ? "parallel" : entry.parallel_decrypt ?
+				"parallel decryption" : entry.mode == EVP_CIPH_XTS_MODE ? "max 16 MiB" : "") << '\n';
+		return 0;
+	}
+
+	std::unique_ptr<Output> output;
+	try {
+		InputFile input(options.input);
+		// XTS takes the input in one piece: refuse what doesn't fit before OUTPUT is touched
+		if (options.mode != Options::HEXDUMP)
+			Crypto::check_size(find_cipher(options.cipher), input.size());
+		output.reset(new Output(options.output, options.direct));
+
+		const auto start = std::chrono::steady_clock::now();
+		const std::size_t workers = options.mode == Options::HEXDUMP ?
+			hexdump(options, input, *output) : crypt(options, input, *output);
+		output->close();
+		const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+		if (options.verbose) {
+			std::cerr << std::fixed << std::setprecision(1)
+				<< input.size() << " bytes in, " << output->written() << " bytes out, "
+				<< seconds.count() << " s, " << input.size() / 1e6 / seconds.count() << " MB/s ("
+				<< workers << (workers == 1 ? " worker" : " workers")
+				<< (input.mapped() ? ", mapped" : "") << (output->direct() ? ", O_DIRECT" : "")
+				<< ")" << std::endl;
+		}
+	}
+	catch (std::exception &e) {
+		if (output != nullptr)
+			output->remove();
+		std::cerr << "wtcrypto-cli: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
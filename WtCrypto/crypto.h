@@ -21,82 +21,117 @@
 
 #pragma once
 
-#include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
-#include <openssl/rand.h>
+#include <openssl/objects.h>
 
 #include <string>
 #include <vector>
-#include <map>
+#include <memory>
+#include <future>
 #include <utility>
+#include <algorithm>
 #include <exception>
-
+#include <stdexcept>
+#include <sstream>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include "bytepool.h"
+#include "cryptoruntime.h"
+#include "hexcodec.h"
+#include "metrics.h"
+#include "randompool.h"
 #include "scopeguard.h"
+#include "threadpool.h"
+
+#ifndef EVP_CTRL_AEAD_GET_TAG
+// OpenSSL 1.0.x only knows the GCM names
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG EVP_CTRL_GCM_SET_TAG
+#endif
 
 class Crypto {
 public:
-	using Bytes = std::vector<unsigned char>;
-	using cipher_map_t = std::map<std::string, const EVP_CIPHER *>;
-
-	Crypto(const EVP_CIPHER *cipher = nullptr) : cipher_(cipher) {
-		ERR_load_crypto_strings();
-		OpenSSL_add_all_algorithms();
-		OPENSSL_config(NULL);
-	}
-
-	~Crypto() {
-		EVP_cleanup();
-		CRYPTO_cleanup_all_ex_data();
-		ERR_free_strings();
-	}
-
-	static const cipher_map_t CipherMap() {
-		const cipher_map_t ciphers = {
-			{ "EVP_aes_128_cbc",      EVP_aes_128_cbc() },
-			{ "EVP_aes_128_ecb",      EVP_aes_128_ecb() },
-			{ "EVP_aes_192_cbc",      EVP_aes_192_cbc() },
-			{ "EVP_aes_192_ecb",      EVP_aes_192_ecb() },
-			{ "EVP_aes_256_cbc",      EVP_aes_256_cbc() },
-			{ "EVP_aes_256_ecb",      EVP_aes_256_ecb() },
-			{ "EVP_bf_cbc",           EVP_bf_cbc() },
-			{ "EVP_bf_cfb",           EVP_bf_cfb() },
-			{ "EVP_bf_ecb",           EVP_bf_ecb() },
-			{ "EVP_bf_ofb",           EVP_bf_ofb() },
-			{ "EVP_camellia_128_cbc", EVP_camellia_128_cbc() },
-			{ "EVP_camellia_128_ecb", EVP_camellia_128_ecb() },
-			{ "EVP_camellia_192_cbc", EVP_camellia_192_cbc() },
-			{ "EVP_camellia_256_ecb", EVP_camellia_256_ecb() },
-			{ "EVP_cast5_cbc",        EVP_cast5_cbc() },
-			{ "EVP_cast5_cfb",        EVP_cast5_cfb() },
-			{ "EVP_cast5_ecb",        EVP_cast5_ecb() },
-			{ "EVP_cast5_ofb",        EVP_cast5_ofb() },
-			{ "EVP_des_cbc",          EVP_des_cbc() },
-			{ "EVP_des_cfb",          EVP_des_cfb() },
-			{ "EVP_des_ecb",          EVP_des_ecb() },
-			{ "EVP_des_ofb",          EVP_des_ofb() },
-			{ "EVP_des_ede_cbc",      EVP_des_ede_cbc() },
-			{ "EVP_des_ede_cfb",      EVP_des_ede_cfb() },
-			{ "EVP_des_ede_ofb",      EVP_des_ede_ofb() },
-			{ "EVP_des_ede3_cbc",     EVP_des_ede3_cbc() },
-			{ "EVP_des_ede3_cfb",     EVP_des_ede3_cfb() },
-			{ "EVP_des_ede3_ofb",     EVP_des_ede3_ofb() },
-			// { "EVP_idea_cbc",         EVP_idea_cbc() },
-			// { "EVP_idea_cfb",         EVP_idea_cfb() },
-			// { "EVP_idea_ecb",         EVP_idea_ecb() },
-			// { "EVP_idea_ofb",         EVP_idea_ofb() },
-		};
-		return ciphers;
+	// pooled, and wiped when freed: see BytePool
+	using Bytes = PooledBytes;
+
+	// Non-owning view of contiguous bytes (stand-in for C++20 std::span).
+	template <class T>
+	class BasicSpan {
+	public:
+		BasicSpan(T *data, const std::size_t size) : data_(data), size_(size) {}
+		template <class Container>
+		BasicSpan(Container &c) : data_(c.data()), size_(c.size()) {}
+
+		T *data() const { return data_; }
+		std::size_t size() const { return size_; }
+		T *begin() const { return data_; }
+		T *end() const { return data_ + size_; }
+
+		BasicSpan subspan(const std::size_t offset) const {
+			assert(offset <= size_);
+			return BasicSpan(data_ + offset, size_ - offset);
+		}
+
+	private:
+		T *data_;
+		std::size_t size_;
+	};
+	using Span = BasicSpan<unsigned char>;
+	using ConstSpan = BasicSpan<const unsigned char>;
+
+	// library setup and teardown are process-wide, see CryptoRuntime
+	Crypto(const EVP_CIPHER *cipher = nullptr) :
+		cipher_(cipher),
+		pool_(&ThreadPool::instance()) {
+		CryptoRuntime::init();
+	}
+
+	// Inputs of at least PARALLEL_THRESHOLD bytes are split across
+	// a thread pool when the cipher mode allows it, in segments of
+	// at least PARALLEL_MIN_SEGMENT bytes.
+	static constexpr std::size_t PARALLEL_THRESHOLD = 1u << 20;
+	static constexpr std::size_t PARALLEL_MIN_SEGMENT = 1u << 18;
+
+	// Batches are spread across threads in chunks of at least this
+	// many bytes of input.
+	static constexpr std::size_t BATCH_MIN_CHUNK = 1u << 15;
+
+	// AEAD ciphers (GCM, ChaCha20-Poly1305) append a tag of this size
+	// to the ciphertext, and verify it when decrypting.
+	static constexpr std::size_t AEAD_TAG_LENGTH = 16;
+
+	// OpenSSL takes at most 2^20 blocks per XTS data unit, and every
+	// message (and every Stream::update()) is one.
+	static constexpr std::size_t XTS_MAX = std::size_t(16) << 20;
+
+	// Throws std::runtime_error if cipher can't take a message of
+	// nbytes at once, before anything is allocated for it.
+	static void check_size(const EVP_CIPHER *cipher, const std::uint64_t nbytes) {
+		if (EVP_CIPHER_mode(cipher) != EVP_CIPH_XTS_MODE || nbytes == 0)
+			return;
+		// XTS can't steal from a block that isn't there
+		if (nbytes < static_cast<std::uint64_t>(EVP_CIPHER_iv_length(cipher)))
+			throw std::runtime_error("XTS needs at least one full block of input");
+		if (nbytes > XTS_MAX)
+			throw std::runtime_error("XTS input is limited to 16 MiB");
 	}
 
-	void setCipher(const EVP_CIPHER *cipher) { cipher_ = cipher; }
+	void setCipher(const EVP_CIPHER *cipher) {
+		cipher_ = cipher;
+		invalidate();
+	}
+	const EVP_CIPHER *cipher() const { return cipher_; }
 
-	const Bytes key() const { return key_; }
-	const Bytes iv() const { return iv_; }
+	const Bytes &key() const { return key_; }
+	const Bytes &iv() const { return iv_; }
 
 	void newKey() {
 		assert(cipher_ != nullptr);
 		key_ = newrand<EVP_MAX_KEY_LENGTH>(EVP_CIPHER_key_length(cipher_));
+		invalidate();
 	}
 
 	void newIV() {
@@ -104,108 +139,483 @@ public:
 		iv_ = newrand<EVP_MAX_IV_LENGTH>(EVP_CIPHER_iv_length(cipher_));
 	}
 
-	Bytes encrypt(const Bytes &plaintext) {
-		assert(cipher_ != nullptr);
-		EVP_CIPHER_CTX ctx;
-		ScopeGuard guard(&ctx);
+	// Keys and IVs of cipher for count messages, packed back to back
+	// as Batch::keys and Batch::ivs take them.
+	struct KeyIVs {
+		Bytes keys;
+		Bytes ivs;
+	};
+
+	static KeyIVs newKeyIVs(const EVP_CIPHER *cipher, const std::size_t count) {
+		KeyIVs result;
+		result.keys.resize(count * static_cast<std::size_t>(EVP_CIPHER_key_length(cipher)));
+		result.ivs.resize(count * static_cast<std::size_t>(EVP_CIPHER_iv_length(cipher)));
+		RandomPool::fill(result.keys.data(), result.keys.size());
+		RandomPool::fill(result.ivs.data(), result.ivs.size());
+		return result;
+	}
+
+	// Stateful encryptor / decryptor on a single EVP_CIPHER_CTX.
+	//
+	// The key schedule is computed once, in the constructor. Call
+	// begin() once per message, which only resets the IV, then
+	// update() on chunks of any size, then finish().
+	//
+	// Output goes either into caller-owned memory (Span overloads,
+	// which also work in place, i.e. with in.data() == out.data()), or
+	// is appended to a Bytes buffer that may be flushed and cleared
+	// between chunks to process arbitrarily large inputs in constant
+	// memory. The concatenated output is identical to a one-shot
+	// encrypt() / decrypt(). (Except for XTS, where every update()
+	// is a data unit of its own, of one block to XTS_MAX bytes.)
+	class Stream {
+	public:
+		enum Direction { DECRYPT = 0, ENCRYPT = 1 };
+
+		Stream(const EVP_CIPHER *cipher, const Bytes &key, const Bytes &iv,
+			const Direction dir) :
+			ctx_(EVP_CIPHER_CTX_new()),
+			cipher_(cipher),
+			iv_(iv),
+			dir_(dir) {
+			assert(cipher_ != nullptr);
+			if (ctx_.get() == nullptr)
+				throw std::runtime_error(error_msg());
+
+			if (1 != EVP_CipherInit_ex(ctx_.get(),
+				cipher_,
+				NULL,
+				key.data(),
+				NULL,
+				dir)) {
+				throw std::runtime_error(error_msg());
+			}
+		}
 
-		EVP_CIPHER_CTX_init(&ctx);
+		// start a new message with the IV given at construction
+		void begin() {
+			begin(iv_);
+		}
 
-		if (1 != EVP_EncryptInit_ex(&ctx,
-			cipher_,
-			NULL,
-			key_.data(),
-			iv_.data())) {
-			throw std::runtime_error(error_msg());
+		// start a new message with another IV, keeping the key schedule
+		void begin(ConstSpan iv) {
+			if (1 != EVP_CipherInit_ex(ctx_.get(),
+				NULL,
+				NULL,
+				NULL,
+				iv.data(),
+				-1)) {
+				throw std::runtime_error(error_msg());
+			}
+			tag_set_ = false;
 		}
 
-		// output buffer size = inl + cipher_block_size - 1
-		Bytes ciphertext(plaintext.size() + 16 - 1);
+		// Writes into out, which needs room for in.size() plus one block
+		// (exactly: the bytes completing the pending partial block).
+		// Returns the number of bytes written.
+		std::size_t update(ConstSpan in, Span out) {
+			const unsigned char *ip = in.data();
+			std::size_t inl = in.size();
+			std::size_t written = 0;
+
+			// EVP_CipherUpdate() takes an int length: feed it in slices.
+			while (inl > 0) {
+				const std::size_t n = inl < MAX_SLICE ? inl : MAX_SLICE;
+
+				int outl = 0;
+				if (1 != EVP_CipherUpdate(ctx_.get(), out.data() + written, &outl,
+					ip, static_cast<int>(n))) {
+					throw std::runtime_error(error_msg());
+				}
+				written += outl;
+				assert(written <= out.size());
+
+				ip += n;
+				inl -= n;
+			}
+			return written;
+		}
 
-		int outl = 0;
-		if (1 != EVP_EncryptUpdate(&ctx, ciphertext.data(), &outl,
-			plaintext.data(), static_cast<int>(plaintext.size()))) {
-			throw std::runtime_error(error_msg());
+		// Writes at most one block into out, returns bytes written.
+		// Decrypting with a tag from set_tag(), failure means the tag
+		// didn't match (which leaves nothing on OpenSSL's error queue).
+		std::size_t finish(Span out) {
+			int outl = 0;
+			if (1 != EVP_CipherFinal_ex(ctx_.get(), out.data(), &outl)) {
+				if (dir_ == DECRYPT && tag_set_)
+					throw std::runtime_error("Authentication tag mismatch");
+				throw std::runtime_error(error_msg());
+			}
+			assert(static_cast<std::size_t>(outl) <= out.size());
+			return outl;
 		}
-		ciphertext.resize(outl);
 
-		Bytes finalblock(16);
-		if (1 != EVP_EncryptFinal_ex(&ctx, finalblock.data(), &outl)) {
-			throw std::runtime_error(error_msg());
+		// replace the key schedule, e.g. for a batch with many keys
+		void rekey(ConstSpan key) {
+			if (1 != EVP_CipherInit_ex(ctx_.get(),
+				NULL,
+				NULL,
+				key.data(),
+				NULL,
+				-1)) {
+				throw std::runtime_error(error_msg());
+			}
 		}
-		for (int i = 0; i < outl; ++i)
-			ciphertext.push_back(finalblock[i]);
 
-		return ciphertext;
+		// en/disable PKCS padding for the current message, after begin()
+		void set_padding(const bool padding) {
+			EVP_CIPHER_CTX_set_padding(ctx_.get(), padding ? 1 : 0);
+		}
+
+		// AEAD ciphers: fetch the tag after finish() when encrypting ...
+		void get_tag(Span tag) {
+			if (1 != EVP_CIPHER_CTX_ctrl(ctx_.get(), EVP_CTRL_AEAD_GET_TAG,
+				static_cast<int>(tag.size()), tag.data())) {
+				throw std::runtime_error(error_msg());
+			}
+		}
+
+		// ... and set the expected tag before finish() when decrypting.
+		void set_tag(ConstSpan tag) {
+			if (1 != EVP_CIPHER_CTX_ctrl(ctx_.get(), EVP_CTRL_AEAD_SET_TAG,
+				static_cast<int>(tag.size()),
+				const_cast<unsigned char *>(tag.data()))) {
+				throw std::runtime_error(error_msg());
+			}
+			tag_set_ = true;
+		}
+
+		void update(const unsigned char *in, std::size_t inl, Bytes &out) {
+			const std::size_t pos = out.size();
+
+			// output buffer size = inl + cipher_block_size
+			out.resize(pos + inl + block_size());
+			try {
+				out.resize(pos + update(ConstSpan(in, inl), Span(out).subspan(pos)));
+			}
+			catch (...) {
+				out.resize(pos);
+				throw;
+			}
+		}
+
+		void update(const Bytes &in, Bytes &out) {
+			update(in.data(), in.size(), out);
+		}
+
+		void finish(Bytes &out) {
+			const std::size_t pos = out.size();
+
+			out.resize(pos + block_size());
+			try {
+				out.resize(pos + finish(Span(out).subspan(pos)));
+			}
+			catch (...) {
+				out.resize(pos);
+				throw;
+			}
+		}
+
+		std::size_t block_size() const {
+			return static_cast<std::size_t>(EVP_CIPHER_block_size(cipher_));
+		}
+
+	private:
+		static constexpr std::size_t MAX_SLICE = 1u << 30;
+
+		ScopeGuard ctx_;
+		const EVP_CIPHER *cipher_;
+		Bytes iv_;
+		const Direction dir_;
+		bool tag_set_ = false; // for the current message
+	};
+
+	// Use pool for large inputs (default: ThreadPool::instance()),
+	// or always run on the calling thread if pool == nullptr.
+	void setThreadPool(ThreadPool *pool) { pool_ = pool; }
+
+	Stream encryptor() const {
+		assert(cipher_ != nullptr);
+		return Stream(cipher_, key_, iv_, Stream::ENCRYPT);
 	}
 
-	Bytes decrypt(const Bytes &ciphertext) {
+	Stream decryptor() const {
 		assert(cipher_ != nullptr);
-		EVP_CIPHER_CTX ctx;
-		ScopeGuard guard(&ctx);
+		return Stream(cipher_, key_, iv_, Stream::DECRYPT);
+	}
+
+	static bool isAEAD(const EVP_CIPHER *cipher) {
+		return (EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) != 0;
+	}
+
+	// Can blocks at arbitrary offsets be processed independently?
+	// ECB and CTR: always. CBC and full-block CFB: when decrypting,
+	// because each block only depends on the previous _ciphertext_
+	// block, which is known up front.
+	static bool parallelizable(const EVP_CIPHER *cipher, const Stream::Direction dir) {
+		switch (EVP_CIPHER_mode(cipher)) {
+		case EVP_CIPH_ECB_MODE:
+		case EVP_CIPH_CTR_MODE:
+			return true;
+		case EVP_CIPH_CBC_MODE:
+			return dir == Stream::DECRYPT;
+		case EVP_CIPH_CFB_MODE:
+			// CFB1 and CFB8 feed back less than a block
+			return cfb_segment(cipher) != 1 && dir == Stream::DECRYPT;
+		default:
+			return false;
+		}
+	}
+
+	// Bytes per CFB segment: a whole block, or a single byte for CFB1
+	// and CFB8 (both start afresh at every byte boundary from the last
+	// iv length bytes of ciphertext).
+	static std::size_t cfb_segment(const EVP_CIPHER *cipher) {
+		const std::string name = OBJ_nid2sn(EVP_CIPHER_nid(cipher));
+		if (name.find("CFB1") != std::string::npos || name.find("CFB8") != std::string::npos)
+			return 1;
+		return EVP_CIPHER_iv_length(cipher);
+	}
 
-		EVP_CIPHER_CTX_init(&ctx);
+	// Granularity of parallel processing: a whole block, and a whole
+	// counter (CTR) or feedback segment (CFB).
+	static std::size_t parallel_unit(const EVP_CIPHER *cipher) {
+		return static_cast<std::size_t>(std::max(EVP_CIPHER_block_size(cipher),
+			EVP_CIPHER_iv_length(cipher)));
+	}
 
-		if (1 != EVP_DecryptInit_ex(&ctx,
-			cipher_,
-			NULL,
-			key_.data(),
-			iv_.data())) {
-			throw std::runtime_error(error_msg());
+	// The IV that starts a Stream at offset into a message, for modes
+	// where parallelizable(): iv itself in ECB mode, the counter
+	// advanced to offset in CTR mode, and the last iv length bytes of
+	// before, the input that ends at offset, when decrypting CBC / CFB.
+	// offset has to be a multiple of parallel_unit().
+	static Bytes iv_at(const EVP_CIPHER *cipher, const Bytes &iv, const std::size_t offset,
+		ConstSpan before) {
+		assert(offset % parallel_unit(cipher) == 0);
+		switch (EVP_CIPHER_mode(cipher)) {
+		case EVP_CIPH_CTR_MODE:
+			return ctr_advance(iv, offset / parallel_unit(cipher));
+		case EVP_CIPH_CBC_MODE:
+		case EVP_CIPH_CFB_MODE:
+			if (offset == 0)
+				return iv;
+			assert(before.size() >= iv.size());
+			return Bytes(before.end() - iv.size(), before.end());
+		default:
+			return iv;
 		}
+	}
+
+	// length of the tag at the end of the ciphertext, 0 if none
+	std::size_t tag_length() const {
+		assert(cipher_ != nullptr);
+		return isAEAD(cipher_) ? AEAD_TAG_LENGTH : 0;
+	}
 
-		// output buffer size = inl + cipher_block_size
-		Bytes plaintext(ciphertext.size() + 16);
+	// Exact output size of encrypt() for a given plaintext size:
+	// padded to the next full block for block ciphers with a block
+	// size > 1 (always adding one block), unchanged for stream modes,
+	// plus the tag for AEAD ciphers.
+	std::size_t ciphertext_size(const std::size_t nbytes) const {
+		assert(cipher_ != nullptr);
+		const std::size_t bs = EVP_CIPHER_block_size(cipher_);
+		if (bs <= 1)
+			return nbytes + tag_length();
+		return (nbytes / bs + 1) * bs;
+	}
+
+	// Upper bound of decrypt()'s output size: padding only shrinks.
+	std::size_t plaintext_size(const std::size_t nbytes) const {
+		return nbytes - std::min(nbytes, tag_length());
+	}
+
+	// Encrypt into caller-owned memory of at least
+	// ciphertext_size(plaintext.size()) bytes, without allocating.
+	// May be done in place (plaintext.data() == ciphertext.data()).
+	// Returns the number of bytes written.
+	std::size_t encrypt(ConstSpan plaintext, Span ciphertext) {
+		if (ciphertext.size() < ciphertext_size(plaintext.size()))
+			throw std::length_error("Ciphertext buffer too small");
+		check_input(plaintext.size());
+		Metrics::CryptoTimer timer(cipher_, Metrics::ENCRYPT, plaintext.size());
+
+		if (parallel(Stream::ENCRYPT, plaintext.size()))
+			return crypt_parallel(plaintext, ciphertext, Stream::ENCRYPT);
+
+		return encrypt_with(cached(enc_, Stream::ENCRYPT), iv_, plaintext, ciphertext);
+	}
+
+	// Decrypt into caller-owned memory of at least
+	// plaintext_size(ciphertext.size()) bytes, without allocating.
+	// May be done in place. Returns the number of bytes written.
+	std::size_t decrypt(ConstSpan ciphertext, Span plaintext) {
+		if (plaintext.size() < plaintext_size(ciphertext.size()))
+			throw std::length_error("Plaintext buffer too small");
+		check_input(ciphertext.size());
+		Metrics::CryptoTimer timer(cipher_, Metrics::DECRYPT, ciphertext.size());
+
+		if (parallel(Stream::DECRYPT, ciphertext.size()))
+			return crypt_parallel(ciphertext, plaintext, Stream::DECRYPT);
+
+		return decrypt_with(cached(dec_, Stream::DECRYPT), iv_, ciphertext, plaintext);
+	}
+
+	// ciphertext[offset, offset + removed) was replaced by inserted bytes
+	struct Patch {
+		std::size_t offset;
+		std::size_t removed;
+		std::size_t inserted;
+	};
+
+	// Bring ciphertext, the encryption of a previous version of
+	// plaintext with the current key and IV, up to date after
+	// plaintext[offset, end) changed; if the length changed, end
+	// has to be plaintext.size(). Only what depends on the change is
+	// encrypted again: the touched blocks in ECB and CTR mode, the
+	// rest of the message from the first touched block on in CBC and
+	// CFB mode. The result is byte-identical to encrypt(plaintext).
+	// Returns false and leaves ciphertext alone in all other modes,
+	// where any change affects the whole ciphertext (or tag).
+	bool reencrypt(ConstSpan plaintext, std::size_t offset, std::size_t end,
+		Bytes &ciphertext, Patch *patch = nullptr) {
+		assert(cipher_ != nullptr);
+		if (isAEAD(cipher_))
+			return false;
+
+		// re-encryption has to start at a multiple of unit; in chained
+		// modes it has to go on up to the end of the message
+		std::size_t unit;
+		bool chained;
+		switch (EVP_CIPHER_mode(cipher_)) {
+		case EVP_CIPH_ECB_MODE:
+			unit = EVP_CIPHER_block_size(cipher_);
+			chained = false;
+			break;
+		case EVP_CIPH_CTR_MODE:
+			unit = EVP_CIPHER_iv_length(cipher_);
+			chained = false;
+			break;
+		case EVP_CIPH_CBC_MODE:
+			unit = EVP_CIPHER_block_size(cipher_);
+			chained = true;
+			break;
+		case EVP_CIPH_CFB_MODE:
+			unit = cfb_segment(cipher_);
+			chained = true;
+			break;
+		default:
+			return false;
+		}
 
-		int outl = 0;
-		if (1 != EVP_DecryptUpdate(&ctx, plaintext.data(), &outl,
-			ciphertext.data(), static_cast<int>(ciphertext.size()))) {
-			throw std::runtime_error(error_msg());
+		const std::size_t n = plaintext.size();
+		const std::size_t total = ciphertext_size(n);
+		end = std::min(end, n);
+		offset = std::min(offset, end);
+
+		const std::size_t first = offset / unit * unit;
+		if (first > ciphertext.size())
+			return false; // not the ciphertext of a previous version
+		check_input(n);
+
+		// Stop after the last touched unit, unless that is the last,
+		// (partial) one: then the padding has to be redone, too.
+		std::size_t stop = chained ? n : std::min(n, (end + unit - 1) / unit * unit);
+		const bool to_end = stop >= n / unit * unit;
+		if (to_end)
+			stop = n;
+		else if (ciphertext.size() != total)
+			return false; // the length did change after all
+
+		// state of the cipher at first: the IV, advanced (CTR), or the
+		// ciphertext that went before (CBC / CFB)
+		Bytes iv = iv_;
+		if (EVP_CIPHER_mode(cipher_) == EVP_CIPH_CTR_MODE)
+			iv = ctr_advance(iv_, first / unit);
+		else if (chained && first != 0) {
+			const std::size_t ivlen = iv_.size();
+			const std::size_t from_iv = first < ivlen ? ivlen - first : 0;
+			iv.assign(iv_.end() - from_iv, iv_.end());
+			iv.insert(iv.end(), ciphertext.begin() + (first - (ivlen - from_iv)),
+				ciphertext.begin() + first);
 		}
-		plaintext.resize(outl);
 
-		Bytes finalblock(16);
-		if (1 != EVP_DecryptFinal_ex(&ctx, finalblock.data(), &outl)) {
-			throw std::runtime_error(error_msg());
+		const std::size_t old_size = ciphertext.size();
+		ciphertext.resize(std::max(old_size, total));
+
+		Stream stream(cipher_, key_, iv, Stream::ENCRYPT);
+		stream.begin();
+		stream.set_padding(to_end);
+		const Span out(ciphertext.data() + first, ciphertext.size() - first);
+		std::size_t outl = stream.update(ConstSpan(plaintext.data() + first, stop - first), out);
+		if (to_end) {
+			outl += stream.finish(out.subspan(outl));
+			ciphertext.resize(first + outl);
 		}
-		for (int i = 0; i < outl; ++i)
-			plaintext.push_back(finalblock[i]);
+		assert(ciphertext.size() == total);
 
+		if (patch != nullptr) {
+			patch->offset = first;
+			patch->removed = to_end ? old_size - first : outl;
+			patch->inserted = outl;
+		}
+		return true;
+	}
+
+	// Many independent messages, stored back to back in one arena:
+	// message i is data[offsets[i], offsets[i+1]). Each message has
+	// its own IV, and optionally its own key (keys empty: use key()).
+	struct Batch {
+		ConstSpan data{ nullptr, 0 };
+		std::vector<std::size_t> offsets; // size() + 1 entries
+		ConstSpan ivs{ nullptr, 0 };      // iv length bytes per message
+		ConstSpan keys{ nullptr, 0 };     // key length bytes per message, or none
+
+		std::size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+	};
+
+	// Encrypt / decrypt all messages of a batch into out, packed back
+	// to back in the same order. Returns the offsets of the results in
+	// out, like Batch::offsets. Large batches are spread across the
+	// thread pool, each thread reusing one keyed context for its share
+	// of messages. Errors are reported with the index of the message.
+	std::vector<std::size_t> encrypt_batch(const Batch &batch, Bytes &out) {
+		return crypt_batch(batch, out, Stream::ENCRYPT);
+	}
+
+	std::vector<std::size_t> decrypt_batch(const Batch &batch, Bytes &out) {
+		return crypt_batch(batch, out, Stream::DECRYPT);
+	}
+
+	Bytes encrypt(const Bytes &plaintext) {
+		check_input(plaintext.size());
+		Bytes ciphertext(ciphertext_size(plaintext.size()));
+		ciphertext.resize(encrypt(ConstSpan(plaintext), Span(ciphertext)));
+		return ciphertext;
+	}
+
+	Bytes decrypt(const Bytes &ciphertext) {
+		check_input(ciphertext.size());
+		Bytes plaintext(plaintext_size(ciphertext.size()));
+		plaintext.resize(decrypt(ConstSpan(ciphertext), Span(plaintext)));
 		return plaintext;
 	}
 
+	// one allocation each, rather than one per doubling
 	static std::string toString(const Bytes &input) {
-		std::string out;
-		for (const auto &byte : input)
-			out.push_back(static_cast<char>(byte));
-		return out;
+		return std::string(input.begin(), input.end());
 	}
 
 	static Bytes toBytes(const std::string &input) {
-		Bytes out;
-		for (const auto &c : input)
-			out.push_back(static_cast<unsigned char>(c));
-		return out;
+		return Bytes(input.begin(), input.end());
 	}
 
+	// throws HexCodec::Error with the position of invalid input
 	static Bytes hexToBytes(const std::string &hexinput) {
-		Bytes out;
-		if (hexinput.size() % 2)
-			return out; // odd size, invalid hex
-		for (std::size_t i = 0; i != hexinput.size(); i += 2) {
-			std::string hextwo;
-			hextwo.push_back(hexinput[i]);
-			hextwo.push_back(hexinput[i + 1]);
-			std::istringstream iss(hextwo);
-			unsigned int c;
-			iss >> std::hex >> c;
-			out.push_back(static_cast<unsigned char>(c));
-		}
-		return out;
+		return HexCodec::decode<Bytes>(hexinput);
 	}
 
 private:
-	std::string error_msg() {
+	static std::string error_msg() {
 		std::ostringstream ess;
 		while (auto err = ERR_get_error()) {
 			char buf[256];
@@ -215,20 +625,247 @@ private:
 		return ess.str();
 	}
 
+	// keyed contexts are reused across messages until the
+	// cipher or the key changes; only the IV is reset per message.
+	Stream &cached(std::unique_ptr<Stream> &stream, const Stream::Direction dir) {
+		assert(cipher_ != nullptr);
+		if (!stream)
+			stream = std::make_unique<Stream>(cipher_, key_, iv_, dir);
+		return *stream;
+	}
+
+	void invalidate() {
+		enc_.reset();
+		dec_.reset();
+	}
+
+	void check_input(const std::size_t nbytes) const {
+		check_size(cipher_, nbytes);
+	}
+
+	// one message through an already keyed stream, tag included
+	std::size_t encrypt_with(Stream &enc, ConstSpan iv, ConstSpan plaintext, Span ciphertext) {
+		enc.begin(iv);
+		std::size_t outl = enc.update(plaintext, ciphertext);
+		outl += enc.finish(ciphertext.subspan(outl));
+
+		if (const std::size_t taglen = tag_length()) {
+			enc.get_tag(Span(ciphertext.data() + outl, taglen));
+			outl += taglen;
+		}
+		return outl;
+	}
+
+	std::size_t decrypt_with(Stream &dec, ConstSpan iv, ConstSpan ciphertext, Span plaintext) {
+		// AEAD: the trailing tag is not part of the message proper
+		const std::size_t taglen = tag_length();
+		if (ciphertext.size() < taglen)
+			throw std::runtime_error("Ciphertext shorter than authentication tag");
+		const std::size_t msglen = ciphertext.size() - taglen;
+
+		dec.begin(iv);
+		std::size_t outl = dec.update(ConstSpan(ciphertext.data(), msglen), plaintext);
+		if (taglen == 0)
+			return outl + dec.finish(plaintext.subspan(outl));
+
+		dec.set_tag(ConstSpan(ciphertext.data() + msglen, taglen));
+		return outl + dec.finish(plaintext.subspan(outl));
+	}
+
+	// Run task(0) ... task(ntasks - 1), all but the last one on the
+	// pool, the last one on the calling thread. Waits for all tasks
+	// (they may write into caller's buffers), then rethrows the first
+	// exception, if any.
+	template <class Task>
+	void run_parallel(const std::size_t ntasks, Task task) {
+		std::vector<std::future<void>> results;
+		for (std::size_t k = 0; k + 1 < ntasks; ++k)
+			results.push_back(pool_->submit([&task, k] { task(k); }));
+
+		std::exception_ptr error;
+		try {
+			task(ntasks - 1);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		for (auto &result : results) {
+			try {
+				result.get();
+			}
+			catch (...) {
+				if (!error)
+					error = std::current_exception();
+			}
+		}
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	std::vector<std::size_t> crypt_batch(const Batch &batch, Bytes &out,
+		const Stream::Direction dir) {
+		assert(cipher_ != nullptr);
+		const std::size_t n = batch.size();
+		const std::size_t ivlen = EVP_CIPHER_iv_length(cipher_);
+		const std::size_t keylen = EVP_CIPHER_key_length(cipher_);
+
+		for (std::size_t i = 0; i != n; ++i) {
+			if (batch.offsets[i] > batch.offsets[i + 1])
+				throw std::invalid_argument("Batch offsets must not decrease");
+		}
+		if (n != 0 && batch.offsets[n] > batch.data.size())
+			throw std::invalid_argument("Batch offsets beyond data");
+		if (batch.ivs.size() != n * ivlen)
+			throw std::invalid_argument("Batch needs one IV per message");
+		if (batch.keys.size() != 0 && batch.keys.size() != n * keylen)
+			throw std::invalid_argument("Batch needs one key per message, or none");
+
+		// every result gets a slot of its maximum size
+		std::vector<std::size_t> slots(n + 1, 0);
+		for (std::size_t i = 0; i != n; ++i) {
+			const std::size_t len = batch.offsets[i + 1] - batch.offsets[i];
+			slots[i + 1] = slots[i] + (dir == Stream::ENCRYPT ?
+				ciphertext_size(len) : plaintext_size(len));
+		}
+		out.resize(slots[n]);
+		std::vector<std::size_t> lengths(n);
+
+		// messages first ... last - 1 through one stream
+		auto run = [&](Stream &stream, const std::size_t first, const std::size_t last) {
+			const unsigned char *prev_key = nullptr;
+			for (std::size_t i = first; i != last; ++i) {
+				try {
+					if (batch.keys.size() != 0) {
+						const unsigned char *key = batch.keys.data() + i * keylen;
+						if (prev_key == nullptr || !std::equal(key, key + keylen, prev_key))
+							stream.rekey(ConstSpan(key, keylen));
+						prev_key = key;
+					}
+					const ConstSpan iv(batch.ivs.data() + i * ivlen, ivlen);
+					const ConstSpan in(batch.data.data() + batch.offsets[i],
+						batch.offsets[i + 1] - batch.offsets[i]);
+					const Span slot(out.data() + slots[i], slots[i + 1] - slots[i]);
+					check_input(in.size());
+					lengths[i] = dir == Stream::ENCRYPT ?
+						encrypt_with(stream, iv, in, slot) :
+						decrypt_with(stream, iv, in, slot);
+				}
+				catch (std::exception &e) {
+					throw std::runtime_error("Message " + std::to_string(i) + ": " + e.what());
+				}
+			}
+		};
+
+		const std::size_t total = n == 0 ? 0 : batch.offsets[n] - batch.offsets[0];
+		const std::size_t nchunks = (pool_ == nullptr || pool_->size() <= 1) ? 1 :
+			std::max<std::size_t>(1, std::min({ pool_->size() + 1, n,
+				total / BATCH_MIN_CHUNK }));
+
+		if (nchunks == 1 && batch.keys.size() == 0) {
+			run(cached(dir == Stream::ENCRYPT ? enc_ : dec_, dir), 0, n);
+		}
+		else if (nchunks == 1) {
+			// rekeying must not touch the cached contexts
+			Stream stream(cipher_, key_, iv_, dir);
+			run(stream, 0, n);
+		}
+		else {
+			// split messages into chunks of about equal byte counts
+			std::vector<std::size_t> bounds(nchunks + 1, n);
+			bounds[0] = 0;
+			for (std::size_t i = 0, k = 1; i != n && k != nchunks; ++i) {
+				if (batch.offsets[i] - batch.offsets[0] >= k * total / nchunks)
+					bounds[k++] = i;
+			}
+			run_parallel(nchunks, [&](const std::size_t k) {
+				Stream stream(cipher_, key_, iv_, dir);
+				run(stream, bounds[k], bounds[k + 1]);
+			});
+		}
+
+		// close the gaps left by padding / tags
+		std::vector<std::size_t> offsets(n + 1, 0);
+		for (std::size_t i = 0; i != n; ++i) {
+			if (offsets[i] != slots[i])
+				std::memmove(out.data() + offsets[i], out.data() + slots[i], lengths[i]);
+			offsets[i + 1] = offsets[i] + lengths[i];
+		}
+		out.resize(offsets[n]);
+		return offsets;
+	}
+
+	bool parallel(const Stream::Direction dir, const std::size_t nbytes) const {
+		assert(cipher_ != nullptr);
+		return pool_ != nullptr && pool_->size() > 1 &&
+			nbytes >= PARALLEL_THRESHOLD && parallelizable(cipher_, dir);
+	}
+
+	// IV of the block `blocks` blocks into a CTR stream: iv + blocks,
+	// as a big-endian integer, like OpenSSL increments the counter.
+	static Bytes ctr_advance(Bytes ctr, std::size_t blocks) {
+		for (std::size_t i = ctr.size(); i-- > 0 && blocks != 0; ) {
+			const std::size_t sum = ctr[i] + (blocks & 0xff);
+			ctr[i] = static_cast<unsigned char>(sum);
+			blocks = (blocks >> 8) + (sum >> 8);
+		}
+		return ctr;
+	}
+
+	// Split in at block boundaries into one segment per thread (plus
+	// one for the calling thread), and process them concurrently with
+	// independently keyed contexts. Only the last segment is padded
+	// (encryption) or unpadded (decryption), so that the output is
+	// byte-identical to the serial path. Works in place, too.
+	std::size_t crypt_parallel(ConstSpan in, Span out, const Stream::Direction dir) {
+		const std::size_t unit = parallel_unit(cipher_);
+
+		const std::size_t units = in.size() / unit;
+		const std::size_t min_units = (PARALLEL_MIN_SEGMENT + unit - 1) / unit;
+		const std::size_t nseg = std::max<std::size_t>(1,
+			std::min(pool_->size() + 1, units / min_units));
+		const std::size_t seg_len = (units / nseg) * unit;
+
+		// Compute every segment's IV before any output is written:
+		// in place, the previous ciphertext block would be gone.
+		std::vector<Bytes> ivs(nseg);
+		for (std::size_t k = 0; k != nseg; ++k)
+			ivs[k] = iv_at(cipher_, iv_, k * seg_len, ConstSpan(in.data(), k * seg_len));
+
+		std::vector<std::size_t> written(nseg);
+		auto segment = [&, dir](const std::size_t k) {
+			const std::size_t offset = k * seg_len;
+			const bool last = k + 1 == nseg;
+			const std::size_t len = last ? in.size() - offset : seg_len;
+
+			Stream stream(cipher_, key_, ivs[k], dir);
+			stream.begin();
+			stream.set_padding(last);
+			const std::size_t outl = stream.update(ConstSpan(in.data() + offset, len),
+				out.subspan(offset));
+			written[k] = outl + stream.finish(out.subspan(offset + outl));
+		};
+
+		run_parallel(nseg, segment);
+
+		return (nseg - 1) * seg_len + written[nseg - 1];
+	}
+
 	template <std::size_t MAXBYTES>
 	Bytes newrand(const std::size_t nbytes) {
 		if (nbytes > MAXBYTES)
 			throw std::out_of_range("Key/IV too long");
 
 		Bytes key(nbytes);
-
-		if (!RAND_bytes(key.data(), static_cast<int>(nbytes))) {
-			throw std::runtime_error(error_msg());
-		}
+		RandomPool::fill(key.data(), nbytes);
 		return key;
 	}
 
 	const EVP_CIPHER *cipher_;
 	Bytes key_;
 	Bytes iv_;
+
+	std::unique_ptr<Stream> enc_; // cached encryption context
+	std::unique_ptr<Stream> dec_; // cached decryption context
+
+	ThreadPool *pool_; // for large, parallelizable inputs; may be nullptr
 };
@@ -0,0 +1,122 @@
+// cryptoruntime.h -- Process-wide OpenSSL initialization
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <openssl/opensslv.h>
+#include <openssl/conf.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#endif
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+/*
+* Initializes libcrypto exactly once per process, and tears it down
+* once when the last CryptoRuntime is gone.
+*
+* Create one CryptoRuntime in main() before any thread may use
+* OpenSSL, and keep it alive until all threads (i.e. all Wt sessions)
+* are done. Crypto also calls CryptoRuntime::init() itself, which is
+* a no-op after the first call. More CryptoRuntimes may come and go
+* meanwhile, only the count of them drops; once it reaches zero, the
+* process is done with OpenSSL for good.
+*
+* OpenSSL 1.0.x is not thread-safe unless the application installs
+* locking callbacks; this is done here as well. OpenSSL 1.1.0+ locks
+* internally and registers its own atexit() cleanup.
+*/
+class CryptoRuntime
+{
+public:
+	CryptoRuntime() {
+		init();
+		++instances();
+	}
+
+	~CryptoRuntime() {
+		if (--instances() != 0)
+			return;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		CRYPTO_set_locking_callback(nullptr);
+		EVP_cleanup();
+		CRYPTO_cleanup_all_ex_data();
+		ERR_free_strings();
+#endif
+	}
+
+	CryptoRuntime(const CryptoRuntime &) = delete;
+	CryptoRuntime &operator=(const CryptoRuntime &) = delete;
+
+	static void init() {
+		static std::once_flag once;
+		std::call_once(once, [] {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+			OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS |
+				OPENSSL_INIT_ADD_ALL_CIPHERS |
+				OPENSSL_INIT_ADD_ALL_DIGESTS |
+				OPENSSL_INIT_LOAD_CONFIG, NULL);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			// Blowfish, CAST5 and single DES live in the legacy
+			// provider since OpenSSL 3.0. Loading it explicitly
+			// means we also have to load the default provider.
+			OSSL_PROVIDER_load(NULL, "legacy");
+			OSSL_PROVIDER_load(NULL, "default");
+			ERR_clear_error(); // legacy provider is optional
+#endif
+#else
+			ERR_load_crypto_strings();
+			OpenSSL_add_all_algorithms();
+			OPENSSL_config(NULL);
+
+			locks().reset(new std::mutex[CRYPTO_num_locks()]);
+			CRYPTO_set_locking_callback(&locking_callback);
+#endif
+		});
+	}
+
+private:
+	static std::atomic<unsigned> &instances() {
+		static std::atomic<unsigned> count{ 0 };
+		return count;
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	static std::unique_ptr<std::mutex[]> &locks() {
+		static std::unique_ptr<std::mutex[]> mutexes;
+		return mutexes;
+	}
+
+	static void locking_callback(int mode, int n, const char * /* file */, int /* line */) {
+		if (mode & CRYPTO_LOCK)
+			locks()[n].lock();
+		else
+			locks()[n].unlock();
+	}
+#endif
+};
@@ -0,0 +1,517 @@
+// downloadresource.cpp -- Stream plaintext, ciphertext or files to the browser
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <Wt/WAny.h>
+#include <Wt/WLogger.h>
+
+#include "downloadresource.h"
+#include "filecryptor.h"
+#include "hexcodec.h"
+
+const std::size_t DownloadResource::CHUNK;
+
+namespace {
+
+constexpr std::uint64_t UNKNOWN = static_cast<std::uint64_t>(-1);
+
+enum class Range { NONE, SATISFIABLE, UNSATISFIABLE };
+
+// A single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range
+// of a body of size bytes, as [first, last]. Anything else, including
+// several ranges, is ignored: the whole body is sent then.
+Range parse_range(const std::string &header, const std::uint64_t size,
+	std::uint64_t &first, std::uint64_t &last)
+{
+	const std::string unit = "bytes=";
+	if (header.compare(0, unit.size(), unit) != 0 ||
+		header.find(',') != std::string::npos)
+		return Range::NONE;
+
+	const std::string spec = header.substr(unit.size());
+	const std::size_t dash = spec.find('-');
+	if (dash == std::string::npos)
+		return Range::NONE;
+
+	auto number = [](const std::string &digits, std::uint64_t &value) {
+		if (digits.empty() || digits.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+		value = std::strtoull(digits.c_str(), nullptr, 10);
+		return true;
+	};
+
+	const std::string from = spec.substr(0, dash), to = spec.substr(dash + 1);
+	if (from.empty()) {
+		std::uint64_t suffix;
+		if (!number(to, suffix))
+			return Range::NONE;
+		if (suffix == 0 || size == 0)
+			return Range::UNSATISFIABLE;
+		first = size - std::min(suffix, size);
+		last = size - 1;
+		return Range::SATISFIABLE;
+	}
+
+	if (!number(from, first))
+		return Range::NONE;
+	if (to.empty())
+		last = size - 1;
+	else if (!number(to, last) || last < first)
+		return Range::NONE;
+	if (first >= size)
+		return Range::UNSATISFIABLE;
+	last = std::min(last, size - 1);
+	return Range::SATISFIABLE;
+}
+
+} // namespace
+
+/*
+* The raw body of one response, read front to back.
+*/
+class DownloadResource::Transfer
+{
+public:
+	virtual ~Transfer() {}
+
+	// size of the raw body; UNKNOWN if only the end will tell
+	// (decrypting removes the padding)
+	virtual std::uint64_t size() const = 0;
+
+	// false once the source has changed under the transfer
+	virtual bool valid() const { return true; }
+
+	// Append raw bytes [pos, pos + n) to out; fewer at the end. pos
+	// never goes back from one call to the next. Returns false,
+	// appending nothing, if getting to pos takes more calls: a call
+	// only does a bounded amount of work.
+	virtual bool read(std::uint64_t pos, std::size_t n, Crypto::Bytes &out) = 0;
+};
+
+namespace {
+
+// the plaintext or ciphertext buffer of an EncDecModel, as it is
+class BufferTransfer : public DownloadResource::Transfer
+{
+public:
+	BufferTransfer(const std::shared_ptr<EncDecModel> &ed_model, const bool ciphertext) :
+		ed_model_(ed_model),
+		ciphertext_(ciphertext),
+		version_(version()) {}
+
+	std::uint64_t size() const override { return buffer().size(); }
+
+	bool valid() const override { return version() == version_; }
+
+	bool read(const std::uint64_t pos, const std::size_t n, Crypto::Bytes &out) override {
+		const Crypto::Bytes &in = buffer();
+		if (pos >= in.size())
+			return true;
+		const std::size_t first = static_cast<std::size_t>(pos);
+		out.insert(out.end(), in.begin() + first, in.begin() + first + std::min(n, in.size() - first));
+		return true;
+	}
+
+private:
+	const Crypto::Bytes &buffer() const {
+		return ciphertext_ ? ed_model_->ciphertext() : ed_model_->plaintext();
+	}
+
+	std::uint64_t version() const {
+		return ciphertext_ ? ed_model_->ciphertext_version() : ed_model_->plaintext_version();
+	}
+
+	std::shared_ptr<EncDecModel> ed_model_;
+	const bool ciphertext_;
+	const std::uint64_t version_;
+};
+
+// Some input put through a Crypto::Stream, CHUNK bytes at a time.
+// Ranges that don't start at 0 start the cipher right there in the
+// modes that allow it (see Crypto::parallelizable()); chained modes
+// are run up to there, SEEK_CHUNKS at a time.
+class StreamTransfer : public DownloadResource::Transfer
+{
+public:
+	// input put through the cipher per read(), while looking for pos
+	constexpr static std::size_t SEEK_CHUNKS = 256;
+
+	// throws std::runtime_error if the cipher can't take the input,
+	// e.g. XTS beyond Crypto::XTS_MAX
+	StreamTransfer(const EVP_CIPHER *cipher, const Crypto::Bytes &key, const Crypto::Bytes &iv,
+		const Crypto::Stream::Direction dir, const std::uint64_t input_size) :
+		crypto_(cipher),
+		stream_(cipher, key, iv, dir),
+		iv_(iv),
+		dir_(dir),
+		taglen_(crypto_.tag_length()),
+		xts_(EVP_CIPHER_mode(cipher) == EVP_CIPH_XTS_MODE),
+		input_size_(input_size) {
+		Crypto::check_size(cipher, input_size);
+	}
+
+	std::uint64_t size() const override {
+		const std::size_t n = static_cast<std::size_t>(input_size_);
+		if (dir_ == Crypto::Stream::ENCRYPT)
+			return crypto_.ciphertext_size(n);
+		if (EVP_CIPHER_block_size(crypto_.cipher()) <= 1)
+			return crypto_.plaintext_size(n);
+		return UNKNOWN; // only the padding tells
+	}
+
+	bool read(const std::uint64_t pos, const std::size_t n, Crypto::Bytes &out) override {
+		if (!started_)
+			start(pos);
+		for (std::size_t steps = 0; !finished_ && buffered_ + available() < pos + n; ++steps) {
+			if (steps == SEEK_CHUNKS && buffered_ + available() < pos)
+				return false; // not there yet: go on in the next call
+			step();
+			drop(pos);
+		}
+		// all input is in: finish before the last bytes go out, as
+		// that checks an AEAD tag
+		if (!finished_ && consumed_ == end_)
+			step();
+		drop(pos);
+		const std::size_t take = std::min(n, available());
+		out.insert(out.end(), buffer_.begin() + head_, buffer_.begin() + head_ + take);
+		head_ += take;
+		buffered_ += take;
+		return true;
+	}
+
+protected:
+	// input bytes [offset, offset + n), valid until the next call
+	virtual Crypto::ConstSpan input(std::uint64_t offset, std::size_t n) = 0;
+
+private:
+	// Start the message, at the unit pos is in where the mode allows
+	// that: the output of these modes lines up with their input.
+	void start(const std::uint64_t pos) {
+		stream_.begin();
+		end_ = input_size_;
+		if (dir_ == Crypto::Stream::DECRYPT && taglen_ != 0) {
+			if (end_ < taglen_)
+				throw std::runtime_error("Ciphertext shorter than authentication tag");
+			end_ -= taglen_;
+			stream_.set_tag(input(end_, taglen_));
+		}
+		started_ = true;
+
+		const EVP_CIPHER *cipher = crypto_.cipher();
+		const std::uint64_t unit = Crypto::parallel_unit(cipher);
+		const std::uint64_t first = pos / unit * unit;
+		if (first == 0 || first >= end_ || !Crypto::parallelizable(cipher, dir_))
+			return;
+		const std::size_t ivlen = iv_.size();
+		const auto before = ivlen != 0 ? input(first - ivlen, ivlen) : Crypto::ConstSpan(nullptr, 0);
+		const Crypto::Bytes iv = Crypto::iv_at(cipher, iv_, static_cast<std::size_t>(first), before);
+		stream_.begin(iv);
+		consumed_ = buffered_ = first;
+	}
+
+	// put the next chunk of input through the cipher
+	void step() {
+		// the output read so far goes, once per chunk
+		buffer_.erase(buffer_.begin(), buffer_.begin() + head_);
+		head_ = 0;
+
+		// XTS can't be fed piecemeal: one chunk of at most Crypto::XTS_MAX
+		const std::uint64_t left = end_ - consumed_;
+		const std::size_t chunk = xts_ ? static_cast<std::size_t>(left) : DownloadResource::CHUNK;
+		const std::size_t len = left < chunk ? static_cast<std::size_t>(left) : chunk;
+
+		const std::size_t old_size = buffer_.size();
+		buffer_.resize(old_size + len + EVP_MAX_BLOCK_LENGTH + taglen_);
+		const Crypto::Span out(buffer_.data() + old_size, buffer_.size() - old_size);
+		std::size_t outl;
+		if (len != 0) {
+			outl = stream_.update(input(consumed_, len), out);
+			consumed_ += len;
+		}
+		else {
+			outl = stream_.finish(out); // checks the tag
+			if (dir_ == Crypto::Stream::ENCRYPT && taglen_ != 0) {
+				stream_.get_tag(Crypto::Span(out.data() + outl, taglen_));
+				outl += taglen_;
+			}
+			finished_ = true;
+		}
+		buffer_.resize(old_size + outl);
+	}
+
+	std::size_t available() const { return buffer_.size() - head_; }
+
+	// forget the output before pos
+	void drop(const std::uint64_t pos) {
+		if (pos <= buffered_)
+			return;
+		const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(pos - buffered_, available()));
+		head_ += n;
+		buffered_ += n;
+	}
+
+	const Crypto crypto_; // for the cipher's sizes
+	Crypto::Stream stream_;
+	const Crypto::Bytes iv_;
+	const Crypto::Stream::Direction dir_;
+	const std::size_t taglen_;
+	const bool xts_;
+	const std::uint64_t input_size_;
+
+	bool started_ = false;
+	bool finished_ = false;
+	std::uint64_t end_ = 0;      // of the input, without the tag
+	std::uint64_t consumed_ = 0; // input put through the cipher
+	std::uint64_t buffered_ = 0; // output position of buffer_[head_]
+	Crypto::Bytes buffer_;       // output; read up to head_
+	std::size_t head_ = 0;
+};
+
+// the ciphertext of an EncDecModel's plaintext, while the model is
+// still encrypting it in the background
+class PlaintextTransfer : public StreamTransfer
+{
+public:
+	PlaintextTransfer(const std::shared_ptr<EncDecModel> &ed_model) :
+		StreamTransfer(ed_model->crypto().cipher(), ed_model->crypto().key(), ed_model->crypto().iv(),
+			Crypto::Stream::ENCRYPT, ed_model->plaintext().size()),
+		ed_model_(ed_model),
+		cipher_(ed_model->crypto().cipher()),
+		key_(ed_model->crypto().key()),
+		iv_(ed_model->crypto().iv()),
+		version_(ed_model->plaintext_version()) {}
+
+	bool valid() const override {
+		const Crypto &crypto = ed_model_->crypto();
+		return ed_model_->plaintext_version() == version_ &&
+			crypto.cipher() == cipher_ && crypto.key() == key_ && crypto.iv() == iv_;
+	}
+
+protected:
+	Crypto::ConstSpan input(const std::uint64_t offset, const std::size_t n) override {
+		return Crypto::ConstSpan(ed_model_->plaintext().data() + offset, n);
+	}
+
+private:
+	std::shared_ptr<EncDecModel> ed_model_;
+	const EVP_CIPHER *cipher_;
+	const Crypto::Bytes key_;
+	const Crypto::Bytes iv_;
+	const std::uint64_t version_;
+};
+
+// a file put through the cipher
+class FileTransfer : public StreamTransfer
+{
+public:
+	FileTransfer(std::unique_ptr<InputFile> file, const EVP_CIPHER *cipher,
+		const Crypto::Bytes &key, const Crypto::Bytes &iv, const Crypto::Stream::Direction dir) :
+		StreamTransfer(cipher, key, iv, dir, file->size()),
+		file_(std::move(file)) {}
+
+protected:
+	Crypto::ConstSpan input(const std::uint64_t offset, const std::size_t n) override {
+		return file_->at(offset, n);
+	}
+
+private:
+	std::unique_ptr<InputFile> file_;
+};
+
+// where a response is, between continuations
+struct State {
+	std::shared_ptr<DownloadResource::Transfer> transfer;
+	std::uint64_t pos; // of the body, in bytes as sent (hex digits for HEX)
+	std::uint64_t end; // UNKNOWN: until the transfer runs dry
+};
+
+} // namespace
+
+DownloadResource::DownloadResource(const std::shared_ptr<EncDecModel> &ed_model,
+	const Source source, const Format format) :
+	ed_model_(ed_model),
+	source_(source),
+	format_(format)
+{
+	// the model belongs to the session: read it under the session's lock
+	setTakesUpdateLock(true);
+
+	const std::string ext = format_ == Format::HEX ? ".hex" : ".bin";
+	suggestFileName((source_ == Source::PLAINTEXT ? "plaintext" : "ciphertext") + ext);
+}
+
+DownloadResource::~DownloadResource()
+{
+	beingDeleted();
+}
+
+void DownloadResource::setFile(const std::string &path, const Crypto &crypto,
+	const Crypto::Stream::Direction dir, const std::string &name)
+{
+	file_ = path;
+	file_cipher_ = crypto.cipher();
+	file_key_ = crypto.key();
+	file_iv_ = crypto.iv();
+	file_dir_ = dir;
+	++file_version_;
+	suggestFileName(format_ == Format::HEX ? name + ".hex" : name);
+}
+
+std::shared_ptr<DownloadResource::Transfer> DownloadResource::transfer() const
+{
+	switch (source_) {
+	case Source::PLAINTEXT:
+		return std::make_shared<BufferTransfer>(ed_model_, false);
+	case Source::CIPHERTEXT:
+		if (ed_model_->encrypting())
+			return std::make_shared<PlaintextTransfer>(ed_model_);
+		return std::make_shared<BufferTransfer>(ed_model_, true);
+	case Source::FILE:
+		if (file_.empty())
+			return nullptr;
+		return std::make_shared<FileTransfer>(std::unique_ptr<InputFile>(new InputFile(file_)),
+			file_cipher_, file_key_, file_iv_, file_dir_);
+	default:
+		return nullptr; // NOTREACHED
+	}
+}
+
+// changes whenever the body would
+std::string DownloadResource::etag() const
+{
+	std::string tag;
+	switch (source_) {
+	case Source::PLAINTEXT:
+		tag = "p" + std::to_string(ed_model_->plaintext_version());
+		break;
+	case Source::CIPHERTEXT:
+		tag = "c" + std::to_string(ed_model_->ciphertext_version());
+		break;
+	case Source::FILE:
+		tag = "f" + std::to_string(file_version_);
+		break;
+	}
+	return "\"" + tag + (format_ == Format::HEX ? "h" : "r") + "\"";
+}
+
+void DownloadResource::handleRequest(const Wt::Http::Request &request, Wt::Http::Response &response)
+{
+	std::shared_ptr<State> state;
+	if (request.continuation() != nullptr)
+		state = Wt::cpp17::any_cast<std::shared_ptr<State>>(request.continuation()->data());
+	else {
+		std::shared_ptr<Transfer> transfer;
+		try {
+			transfer = this->transfer();
+		}
+		catch (std::exception &e) {
+			// e.g. a file too large for XTS: say so before any body
+			Wt::log("error") << "DownloadResource: " << e.what();
+			response.setStatus(422);
+			response.setMimeType("text/plain");
+			response.out() << e.what() << "\n";
+			return;
+		}
+		if (transfer == nullptr) {
+			response.setStatus(404);
+			return;
+		}
+
+		const std::uint64_t raw = transfer->size();
+		const std::uint64_t size = raw == UNKNOWN ? UNKNOWN :
+			format_ == Format::HEX ? 2 * raw : raw;
+		state = std::make_shared<State>(State{ transfer, 0, size });
+
+		response.setMimeType(format_ == Format::HEX ? "text/plain" : "application/octet-stream");
+		response.addHeader("ETag", etag());
+		if (size != UNKNOWN) {
+			response.addHeader("Accept-Ranges", "bytes");
+
+			// resume only what hasn't changed since
+			const std::string range = request.headerValue("Range");
+			const std::string if_range = request.headerValue("If-Range");
+			std::uint64_t first = 0, last = 0;
+			if (!range.empty() && (if_range.empty() || if_range == etag())) {
+				switch (parse_range(range, size, first, last)) {
+				case Range::SATISFIABLE:
+					response.setStatus(206);
+					response.addHeader("Content-Range", "bytes " + std::to_string(first) + "-" +
+						std::to_string(last) + "/" + std::to_string(size));
+					state->pos = first;
+					state->end = last + 1;
+					break;
+				case Range::UNSATISFIABLE:
+					response.setStatus(416);
+					response.addHeader("Content-Range", "bytes */" + std::to_string(size));
+					return;
+				case Range::NONE:
+					break;
+				}
+			}
+			response.setContentLength(state->end - state->pos);
+		}
+	}
+
+	// next piece of the body: [pos, stop)
+	const bool hex = format_ == Format::HEX;
+	const std::uint64_t piece = hex ? 2 * CHUNK : CHUNK;
+	const std::uint64_t stop = state->end - state->pos < piece ? state->end : state->pos + piece;
+	const std::uint64_t raw_first = hex ? state->pos / 2 : state->pos;
+	const std::size_t raw_n = static_cast<std::size_t>((hex ? (stop + 1) / 2 : stop) - raw_first);
+
+	Crypto::Bytes raw;
+	if (!state->transfer->valid()) {
+		// cut short: the client sees less than Content-Length
+		Wt::log("info") << "DownloadResource: source changed during download";
+		return;
+	}
+	try {
+		if (!state->transfer->read(raw_first, raw_n, raw)) {
+			// still on the way to the range: don't hold the session
+			response.createContinuation()->setData(state);
+			return;
+		}
+	}
+	catch (std::exception &e) {
+		Wt::log("error") << "DownloadResource: " << e.what();
+		return;
+	}
+
+	std::size_t sent;
+	if (hex) {
+		const std::string digits = HexCodec::encode(raw.data(), raw.size());
+		const std::size_t skip = static_cast<std::size_t>(state->pos - 2 * raw_first);
+		sent = digits.size() <= skip ? 0 :
+			static_cast<std::size_t>(std::min<std::uint64_t>(digits.size() - skip, stop - state->pos));
+		response.out().write(digits.data() + skip, static_cast<std::streamsize>(sent));
+	}
+	else {
+		sent = raw.size();
+		response.out().write(reinterpret_cast<const char *>(raw.data()), static_cast<std::streamsize>(sent));
+	}
+	state->pos += sent;
+
+	if (raw.size() == raw_n && state->pos < state->end)
+		response.createContinuation()->setData(state);
+}
@@ -0,0 +1,82 @@
+// downloadresource.h -- Stream plaintext, ciphertext or files to the browser
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <Wt/WResource.h>
+#include <Wt/Http/Request.h>
+#include <Wt/Http/Response.h>
+
+#include "crypto.h"
+#include "encdecmodel.h"
+
+/*
+* Serves the plaintext or ciphertext of an EncDecModel, or a file put
+* through the cipher, as raw bytes or as hex digits. The body goes out
+* CHUNK bytes per continuation and is produced as it goes: the
+* ciphertext of a plaintext that is still being encrypted, and that of
+* a file, is encrypted on the fly instead of being waited for. Single
+* byte ranges are honoured, so that interrupted downloads can resume.
+* Inputs the cipher can't take at all (XTS beyond 16 MiB) get a 422.
+* Any other error can only cut the body short, as the headers are gone
+* by then; that includes a wrong tag when decrypting AEAD files, which
+* only shows at the end.
+*/
+class DownloadResource : public Wt::WResource
+{
+public:
+	enum class Source { PLAINTEXT, CIPHERTEXT, FILE };
+	enum class Format { RAW, HEX };
+
+	constexpr static std::size_t CHUNK = 64 * 1024; // raw bytes per continuation
+
+	class Transfer; // a response's body, see downloadresource.cpp
+
+	DownloadResource(const std::shared_ptr<EncDecModel> &ed_model, Source source, Format format);
+	~DownloadResource();
+
+	// the FILE source: path put through crypto's cipher, key and iv,
+	// offered to the browser as name
+	void setFile(const std::string &path, const Crypto &crypto, Crypto::Stream::Direction dir,
+		const std::string &name);
+
+protected:
+	void handleRequest(const Wt::Http::Request &request, Wt::Http::Response &response) override;
+
+private:
+	std::shared_ptr<Transfer> transfer() const;
+	std::string etag() const;
+
+	std::shared_ptr<EncDecModel> ed_model_;
+	const Source source_;
+	const Format format_;
+
+	std::string file_;
+	const EVP_CIPHER *file_cipher_ = nullptr;
+	Crypto::Bytes file_key_;
+	Crypto::Bytes file_iv_;
+	Crypto::Stream::Direction file_dir_ = Crypto::Stream::ENCRYPT;
+	unsigned file_version_ = 0; // bumped by setFile()
+};
@@ -19,6 +19,14 @@
 // TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
 // PERFORMANCE OF THIS SOFTWARE.
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include <Wt/WContainerWidget.h>
+
 #include "encdecapplication.h"
 
 /*
@@ -28,14 +36,53 @@ EncDecApplication::EncDecApplication(const Wt::WEnvironment& env)
 	: WApplication(env),
 	ed_model_(std::make_shared<EncDecModel>()),
 	hexdump_model_pt_(std::make_shared<HexDumpTableModel>(ed_model_, HexDumpTableModel::PT)),
-	hexdump_model_ct_(std::make_shared<HexDumpTableModel>(ed_model_, HexDumpTableModel::CT))
+	hexdump_model_ct_(std::make_shared<HexDumpTableModel>(ed_model_, HexDumpTableModel::CT)),
+	hexdump_model_file_(std::make_shared<HexDumpTableModel>())
 {
+	Metrics::Timer timer(Metrics::SESSION_CREATE);
+	Metrics::session(+1);
+
 	hd_validator_ = std::make_shared<Wt::WRegExpValidator>("\\s*([0-9A-Fa-f]{2}\\s+)*([0-9A-Fa-f]{2}\\s*)");
 	hd_delegate_ = std::make_shared<ValidateItemDelegate>(hd_validator_);
 
+	// encrypt once after each event, not after every change it makes
+	ed_model_->setDeferred(true);
+
+	// Encrypt large plaintexts in the background, and push the
+	// ciphertext to the browser chunk by chunk.
+	enableUpdates(true);
+	const std::string session = sessionId();
+	post_ = [session](std::function<void()> f) {
+		Wt::WServer::instance()->post(session, [f]() {
+			f();
+			static_cast<EncDecApplication *>(Wt::WApplication::instance())->showTexts();
+			Wt::WApplication::instance()->triggerUpdate();
+		});
+	};
+	ed_model_->setPoster(post_);
+
 	create_gui();
 	connect_signals();
 	newcipher(); // initialize cipher (and key and iv)
+	ed_model_->flush();
+	showTexts();
+}
+
+EncDecApplication::~EncDecApplication()
+{
+	Metrics::session(-1);
+	cancelfile();
+
+	const auto &stats = ed_model_->stats();
+	Wt::log("info") << "EncDecModel: " << stats.requested << " encryptions requested, "
+		<< stats.performed << " performed, " << stats.avoided() << " avoided";
+}
+
+void EncDecApplication::notify(const Wt::WEvent& event)
+{
+	WApplication::notify(event);
+	ed_model_->flush();
+	showTexts();
 }
 
 void EncDecApplication::create_gui()
@@ -49,8 +96,8 @@ void EncDecApplication::create_gui()
 
 	grid->addWidget(std::make_unique<Wt::WText>("Cipher"), 0, 0);
 	cbCiphers_ = grid->addWidget(std::make_unique<Wt::WComboBox>(), 0, 1);
-	for (const auto &p : ed_model_->ciphers()) {
-		cbCiphers_->addItem(p.first);
+	for (const auto &entry : ed_model_->ciphers()) {
+		cbCiphers_->addItem(entry.name);
 	}
 	cbCiphers_->setCurrentIndex(0);
 	cbCiphers_->setMargin(10, Wt::Side::CenterX);
@@ -64,7 +111,7 @@ void EncDecApplication::create_gui()
 	buttonIV_ = grid->addWidget(std::make_unique<Wt::WPushButton>("New IV"), 2, 2);
 
 	grid->addWidget(std::make_unique<Wt::WText>("Plaintext"), 3, 0);
-	auto tw_plain = grid->addWidget(std::make_unique<Wt::WTabWidget>(), 3, 1);
+	auto tw_plain = plainTextTabs_ = grid->addWidget(std::make_unique<Wt::WTabWidget>(), 3, 1);
 	auto mi_ptta = tw_plain->addTab(std::make_unique<Wt::WTextArea>(),
 		"Plaintext", Wt::ContentLoading::Eager);
 	auto mi_pthd = tw_plain->addTab(std::make_unique<Wt::WTableView>(),
@@ -81,7 +128,7 @@ void EncDecApplication::create_gui()
 	buttonEncrypt_ = grid->addWidget(std::make_unique<Wt::WPushButton>("Encrypt"), 3, 2);
 
 	grid->addWidget(std::make_unique<Wt::WText>("Ciphertext"), 4, 0);
-	auto tw_cipher = grid->addWidget(std::make_unique<Wt::WTabWidget>(), 4, 1);
+	auto tw_cipher = cipherTextTabs_ = grid->addWidget(std::make_unique<Wt::WTabWidget>(), 4, 1);
 	auto mi_cita = tw_cipher->addTab(std::make_unique<Wt::WTextArea>(),
 		"Ciphertext", Wt::ContentLoading::Eager);
 	auto mi_cihd = tw_cipher->addTab(std::make_unique<Wt::WTableView>(),
@@ -96,6 +143,58 @@ void EncDecApplication::create_gui()
 
 	buttonDecrypt_ = grid->addWidget(std::make_unique<Wt::WPushButton>("Decrypt"), 4, 2);
 
+	// AEAD ciphers only: last bytes of the ciphertext
+	grid->addWidget(std::make_unique<Wt::WText>("Tag"), 5, 0);
+	tagText_ = grid->addWidget(std::make_unique<Wt::WText>(), 5, 1);
+	progress_ = grid->addWidget(std::make_unique<Wt::WProgressBar>(), 5, 2);
+	progress_->hide();
+
+	// File mode: the upload goes to disk, and so does the result;
+	// only its first FILE_WINDOW bytes are shown.
+	grid->addWidget(std::make_unique<Wt::WText>("File"), 6, 0);
+	auto file_box = grid->addWidget(std::make_unique<Wt::WContainerWidget>(), 6, 1);
+	fileUpload_ = file_box->addWidget(std::make_unique<Wt::WFileUpload>());
+	fileText_ = file_box->addWidget(std::make_unique<Wt::WText>());
+	auto file_buttons = grid->addWidget(std::make_unique<Wt::WContainerWidget>(), 6, 2);
+	buttonEncryptFile_ = file_buttons->addWidget(std::make_unique<Wt::WPushButton>("Encrypt File"));
+	buttonDecryptFile_ = file_buttons->addWidget(std::make_unique<Wt::WPushButton>("Decrypt File"));
+
+	fileHDView_ = grid->addWidget(std::make_unique<Wt::WTableView>(), 7, 1);
+	fileHDView_->setModel(hexdump_model_file_);
+	fileHDView_->hide();
+
+	// Downloads, produced as they go out
+	grid->addWidget(std::make_unique<Wt::WText>("Download"), 8, 0);
+	auto downloads = grid->addWidget(std::make_unique<Wt::WContainerWidget>(), 8, 1);
+	auto link = [&](const std::shared_ptr<DownloadResource> &resource, const std::string &text) {
+		auto anchor = downloads->addWidget(std::make_unique<Wt::WAnchor>(Wt::WLink(resource), text));
+		anchor->setMargin(10, Wt::Side::Right);
+		return anchor;
+	};
+	using Source = DownloadResource::Source;
+	using Format = DownloadResource::Format;
+	link(std::make_shared<DownloadResource>(ed_model_, Source::PLAINTEXT, Format::RAW), "Plaintext");
+	link(std::make_shared<DownloadResource>(ed_model_, Source::PLAINTEXT, Format::HEX), "(hex)");
+	link(std::make_shared<DownloadResource>(ed_model_, Source::CIPHERTEXT, Format::RAW), "Ciphertext");
+	link(std::make_shared<DownloadResource>(ed_model_, Source::CIPHERTEXT, Format::HEX), "(hex)");
+	download_file_ = std::make_shared<DownloadResource>(ed_model_, Source::FILE, Format::RAW);
+	fileAnchor_ = link(download_file_, "File");
+	fileAnchor_->hide();
+
+	// Search in the plaintext or ciphertext hexdump
+	grid->addWidget(std::make_unique<Wt::WText>("Find"), 9, 0);
+	auto search_box = grid->addWidget(std::make_unique<Wt::WContainerWidget>(), 9, 1);
+	searchEdit_ = search_box->addWidget(std::make_unique<Wt::WLineEdit>());
+	searchFormat_ = search_box->addWidget(std::make_unique<Wt::WComboBox>());
+	searchFormat_->addItem("Text");
+	searchFormat_->addItem("Hex");
+	searchWhere_ = search_box->addWidget(std::make_unique<Wt::WComboBox>());
+	searchWhere_->addItem("in Plaintext");
+	searchWhere_->addItem("in Ciphertext");
+	searchText_ = search_box->addWidget(std::make_unique<Wt::WText>());
+	searchText_->setMargin(10, Wt::Side::Left);
+	buttonFind_ = grid->addWidget(std::make_unique<Wt::WPushButton>("Find Next"), 9, 2);
+
 	grid->setRowStretch(3, 1);
 	grid->setRowStretch(4, 1);
 	grid->setColumnStretch(1, 1);
@@ -108,6 +207,10 @@ void EncDecApplication::create_gui()
 	cipherTextHDView_->setColumnWidth(1, 350);  // hex
 	cipherTextHDView_->setColumnWidth(2, 150);  // print
 
+	fileHDView_->setColumnWidth(0, 80);   // addr
+	fileHDView_->setColumnWidth(1, 350);  // hex
+	fileHDView_->setColumnWidth(2, 150);  // print
+
 	plainTextHDView_->setItemDelegate(hd_delegate_);
 	cipherTextHDView_->setItemDelegate(hd_delegate_);
 
@@ -125,43 +228,297 @@ void EncDecApplication::connect_signals()
 
 	cbCiphers_->changed().connect(this, &EncDecApplication::newcipher);
 
+	buttonFind_->clicked().connect(this, &EncDecApplication::findnext);
+	searchEdit_->enterPressed().connect(this, &EncDecApplication::findnext);
+
 	buttonKey_->clicked().connect([=]() { ed_model_->setKey(); });
 	buttonIV_->clicked().connect([=]() { ed_model_->setIV(); });
 	buttonEncrypt_->clicked().connect([=]() { ed_model_->encrypt(); });
 	buttonDecrypt_->clicked().connect([=]() { ed_model_->decrypt(); });
 
+	// upload the selected file once, then encrypt / decrypt it at will
+	auto file_button = [=](const Crypto::Stream::Direction dir) {
+		file_dir_ = dir;
+		if (file_uploaded_)
+			cryptfile();
+		else {
+			fileText_->setText("Uploading...");
+			fileUpload_->upload();
+		}
+	};
+	buttonEncryptFile_->clicked().connect([=]() { file_button(Crypto::Stream::ENCRYPT); });
+	buttonDecryptFile_->clicked().connect([=]() { file_button(Crypto::Stream::DECRYPT); });
+	fileUpload_->changed().connect([=]() {
+		file_uploaded_ = false;
+	});
+	fileUpload_->uploaded().connect([=]() {
+		file_uploaded_ = true;
+		cryptfile();
+	});
+	fileUpload_->fileTooLarge().connect([=]() {
+		fileText_->setText("File too large (see max-request-size in wt_config.xml)");
+	});
+
 	// connect widgets to ed_model_
 	plainTextEdit_->changed().connect([=]() {
 		ed_model_->setPlaintext(Crypto::toBytes(plainTextEdit_->text().narrow()));
-		hexdump_model_pt_->rescan(ed_model_->plaintext());
 	});
 	cipherTextEdit_->changed().connect([=]() {
-		ed_model_->setCiphertext(Crypto::hexToBytes(cipherTextEdit_->text().narrow()));
-		hexdump_model_ct_->rescan(ed_model_->ciphertext());
+		try {
+			ed_model_->setCiphertext(Crypto::hexToBytes(cipherTextEdit_->text().narrow()));
+		}
+		catch (HexCodec::Error &e) {
+			// leave the model alone, point at the offending character
+			cipherTextEdit_->addStyleClass("Wt-invalid");
+			cipherTextEdit_->setToolTip(e.what());
+			return;
+		}
+		cipherTextEdit_->removeStyleClass("Wt-invalid");
+		cipherTextEdit_->setToolTip("");
 	});
 
-	// connect ed_model_ to widgets
-	ed_model_->plaintextChanged().connect([=](std::string s) {
-		plainTextEdit_->setText(s);
+	// connect ed_model_ to widgets; the text areas follow in showTexts()
+	ed_model_->plaintextChanged().connect([=]() {
+		plaintext_stale_ = true;
 		hexdump_model_pt_->rescan(ed_model_->plaintext());
 	});
-	ed_model_->ciphertextChanged().connect([=](std::string s) {
-		cipherTextEdit_->setText(s);
+	ed_model_->ciphertextChanged().connect([=]() {
+		ciphertext_stale_ = true;
 		hexdump_model_ct_->rescan(ed_model_->ciphertext());
 	});
-	ed_model_->keyivChanged().connect([=](std::string key, std::string iv) {
+	ed_model_->plaintextPatched().connect([=](std::size_t offset, std::size_t count, std::size_t inserted) {
+		plaintext_stale_ = true;
+		hexdump_model_pt_->patched(offset, count, inserted);
+	});
+	ed_model_->ciphertextPatched().connect([=](std::size_t offset, std::size_t count, std::size_t inserted) {
+		ciphertext_stale_ = true;
+		hexdump_model_ct_->patched(offset, count, inserted);
+	});
+	plainTextTabs_->currentChanged().connect([=]() { showTexts(); });
+	cipherTextTabs_->currentChanged().connect([=]() { showTexts(); });
+	ed_model_->keyivChanged().connect([=](const std::string &key, const std::string &iv) {
 		keyText_->setText(key);
 		ivText_->setText(iv);
 	});
-	ed_model_->keyChanged().connect([=](std::string key) {
+	ed_model_->keyChanged().connect([=](const std::string &key) {
 		keyText_->setText(key);
 	});
-	ed_model_->ivChanged().connect([=](std::string iv) {
+	ed_model_->ivChanged().connect([=](const std::string &iv) {
 		ivText_->setText(iv);
 	});
+	ed_model_->encryptProgress().connect([=](std::size_t done, std::size_t total) {
+		progress_->setRange(0, static_cast<double>(total));
+		progress_->setValue(static_cast<double>(done));
+		progress_->setHidden(done == total);
+	});
+	ed_model_->tagChanged().connect([=](const std::string &tag) {
+		tagText_->setText(tag);
+	});
 }
 
 void EncDecApplication::newcipher()
 {
 	ed_model_->setCipher(cbCiphers_->currentText().narrow());
-}
\ No newline at end of file
+}
+
+/*
+* Bring the text areas up to date, once per event however many changes
+* it made, and only those on show: editing the hexdump, the text tab
+* is left alone until it is chosen.
+*/
+void EncDecApplication::showTexts()
+{
+	if (plaintext_stale_ && plainTextTabs_->currentIndex() == 0) {
+		mirror(plainTextEdit_, ed_model_->plaintext().size(),
+			[=]() -> const std::string & { return ed_model_->plaintext_str(); });
+		plaintext_stale_ = false;
+	}
+	if (ciphertext_stale_ && cipherTextTabs_->currentIndex() == 0) {
+		mirror(cipherTextEdit_, 2 * ed_model_->ciphertext().size(),
+			[=]() -> const std::string & { return ed_model_->ciphertext_str(); });
+		ciphertext_stale_ = false;
+	}
+}
+
+/*
+* Show length characters of payload text in edit, made by text(), or
+* only say why not: while the ciphertext is still being encrypted, and
+* for payloads over TEXT_MAX, which the hexdump tab and the download
+* links serve much better. Such a text area can't be edited, either.
+*/
+void EncDecApplication::mirror(Wt::WTextArea *edit, const std::size_t length,
+	const std::function<const std::string &()> &text)
+{
+	const bool busy = edit == cipherTextEdit_ && ed_model_->encrypting();
+	if (!busy && length <= TEXT_MAX) {
+		edit->setText(text());
+		edit->setPlaceholderText("");
+		edit->setDisabled(false);
+		return;
+	}
+
+	edit->setText("");
+	edit->setPlaceholderText(busy ? Wt::WString("Encrypting...") :
+		Wt::WString("{1} characters, too many to show here: see the Hexdump tab, or download").arg(length));
+	edit->setDisabled(true);
+}
+
+/*
+* Highlight the matches of the search pattern in the chosen hexdump
+* view (only there), and scroll to the next one. Repeated searches
+* for the same pattern go from match to match.
+*/
+void EncDecApplication::findnext()
+{
+	const bool pt = searchWhere_->currentIndex() == 0;
+	const auto &model = pt ? hexdump_model_pt_ : hexdump_model_ct_;
+	const auto view = pt ? plainTextHDView_ : cipherTextHDView_;
+
+	std::string text = searchEdit_->text().toUTF8();
+	Crypto::Bytes pattern;
+	if (searchFormat_->currentIndex() == 1) {
+		text.erase(std::remove_if(text.begin(), text.end(),
+			[](const unsigned char c) { return std::isspace(c); }), text.end());
+		try {
+			pattern = Crypto::hexToBytes(text);
+		}
+		catch (HexCodec::Error &e) {
+			searchEdit_->addStyleClass("Wt-invalid");
+			searchText_->setText(e.what());
+			return;
+		}
+	}
+	else
+		pattern = Crypto::toBytes(text);
+	searchEdit_->removeStyleClass("Wt-invalid");
+
+	(pt ? hexdump_model_ct_ : hexdump_model_pt_)->setPattern(Crypto::Bytes());
+	if (pattern != model->pattern())
+		model->setPattern(pattern);
+	if (pattern.empty()) {
+		searchText_->setText("");
+		return;
+	}
+
+	const std::size_t offset = model->findNext();
+	if (offset == HexDumpTableModel::npos) {
+		searchText_->setText("Not found");
+		return;
+	}
+
+	(pt ? plainTextTabs_ : cipherTextTabs_)->setCurrentIndex(1); // the hexdump
+	view->scrollTo(model->index(model->rowOf(offset), 1), Wt::ScrollHint::PositionAtCenter);
+	searchText_->setText(Wt::WString("At offset {1}, {2} in all")
+		.arg(std::to_string(model->address(offset)))
+		.arg(std::to_string(model->matchCount())));
+}
+
+/*
+* Stream the uploaded file through the cipher into a file next to it.
+* The job gets a thread of its own: a multi-GB file would hold a pool
+* thread for minutes, and Crypto's parallel modes wait for those.
+* cancelfile() joins it, so that it never outlives the session, nor
+* OpenSSL.
+*/
+void EncDecApplication::cryptfile()
+{
+	cancelfile();
+
+	const std::string in = fileUpload_->spoolFileName();
+	const std::string out = in + "." + std::to_string(++file_jobs_) +
+		(file_dir_ == Crypto::Stream::ENCRYPT ? ".enc" : ".dec");
+	const auto dir = file_dir_;
+	const auto cancel = file_cancel_ = std::make_shared<std::atomic<bool>>(false);
+	const auto cryptor = std::make_shared<FileCryptor>(ed_model_->crypto());
+	const auto post = post_;
+
+	// the download runs through the cipher by itself, without the job
+	download_file_->setFile(in, ed_model_->crypto(), dir, fileUpload_->clientFileName().toUTF8() +
+		(dir == Crypto::Stream::ENCRYPT ? ".enc" : ".dec"));
+	fileAnchor_->show();
+
+	fileText_->setText(dir == Crypto::Stream::ENCRYPT ? "Encrypting..." : "Decrypting...");
+	progress_->setRange(0, 1);
+	progress_->setValue(0);
+	progress_->show();
+
+	file_thread_ = std::thread([=]() {
+		// a progress update every chunk would flood the browser
+		auto last = std::chrono::steady_clock::now();
+		auto progress = [&](std::uint64_t done, std::uint64_t total) {
+			if (*cancel)
+				return false;
+			const auto now = std::chrono::steady_clock::now();
+			if (now - last >= std::chrono::milliseconds(250)) {
+				last = now;
+				post([=]() {
+					if (*cancel)
+						return;
+					progress_->setRange(0, static_cast<double>(total));
+					progress_->setValue(static_cast<double>(done));
+				});
+			}
+			return true;
+		};
+
+		std::string error;
+		try {
+			if (dir == Crypto::Stream::ENCRYPT)
+				cryptor->encrypt(in, out, progress);
+			else
+				cryptor->decrypt(in, out, progress);
+		}
+		catch (std::exception &e) {
+			error = e.what();
+		}
+		if (*cancel) {
+			std::remove(out.c_str()); // the session may be gone
+			return;
+		}
+
+		post([=]() {
+			if (*cancel)
+				std::remove(out.c_str()); // raced with cancelfile()
+			else
+				filedone(out, error);
+		});
+	});
+}
+
+void EncDecApplication::filedone(const std::string &out, const std::string &error)
+{
+	file_cancel_.reset();
+	progress_->hide();
+	if (!error.empty()) {
+		fileText_->setText(error);
+		return;
+	}
+
+	file_out_ = out;
+	InputFile result(out);
+	const auto window = result.at(0, FILE_WINDOW);
+	file_window_.assign(window.begin(), window.end());
+	hexdump_model_file_->rescan(file_window_);
+	fileHDView_->show();
+
+	fileText_->setText(Wt::WString("{1}: {2} bytes")
+		.arg(fileUpload_->clientFileName())
+		.arg(std::to_string(result.size())));
+}
+
+// Stop the running file job, if any, and drop the last result.
+void EncDecApplication::cancelfile()
+{
+	if (file_cancel_ != nullptr) {
+		*file_cancel_ = true; // the job removes its own output
+		file_cancel_.reset();
+	}
+	if (file_thread_.joinable())
+		file_thread_.join(); // within a chunk, once cancelled
+	if (!file_out_.empty()) {
+		std::remove(file_out_.c_str());
+		file_out_.clear();
+	}
+	file_window_.clear();
+	hexdump_model_file_->rescan(file_window_);
+}
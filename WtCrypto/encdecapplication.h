@@ -27,21 +27,33 @@
 #pragma warning ( disable: 4275 )
 #endif
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <string>
+#include <thread>
 
 #include <Wt/WApplication.h>
 #include <Wt/WGridLayout.h>
 #include <Wt/WTabWidget.h>
 #include <Wt/WMenuItem.h>
 #include <Wt/WTextArea.h>
+#include <Wt/WLineEdit.h>
 #include <Wt/WPushButton.h>
 #include <Wt/WText.h>
 #include <Wt/WComboBox.h>
 #include <Wt/WTableView.h>
+#include <Wt/WFileUpload.h>
+#include <Wt/WAnchor.h>
+#include <Wt/WProgressBar.h>
+#include <Wt/WServer.h>
 #include <Wt/WRegExpValidator.h>
+#include <Wt/WLogger.h>
 
 #include "crypto.h"
+#include "downloadresource.h"
 #include "encdecmodel.h"
+#include "filecryptor.h"
 #include "hexdumpmodel.h"
 #include "validateitemdelegate.h"
 
@@ -52,25 +64,72 @@ class EncDecApplication : public Wt::WApplication
 {
 public:
 	EncDecApplication(const Wt::WEnvironment& env);
+	~EncDecApplication();
+
+protected:
+	// runs the model's pending encryption once per event
+	void notify(const Wt::WEvent& event) override;
 
 private:
+	// the first bytes of a file result shown in its hexdump view
+	constexpr static std::size_t FILE_WINDOW = 64 * 1024;
+
+	// longest payload text mirrored into a text area; a text area gets
+	// its whole string on every change, hexdump views only the rows shown
+	constexpr static std::size_t TEXT_MAX = EncDecModel::ASYNC_THRESHOLD;
+
 	std::shared_ptr<EncDecModel> ed_model_; // model holding our app data
 
 	const std::shared_ptr<HexDumpTableModel> hexdump_model_pt_; // plaintext hexdump model
 	const std::shared_ptr<HexDumpTableModel> hexdump_model_ct_; // ciphertext hexdump model
+	const std::shared_ptr<HexDumpTableModel> hexdump_model_file_; // file result hexdump model
+
+	// runs f in this session, from any thread, and pushes the result
+	std::function<void(std::function<void()>)> post_;
 
 	// widgets displaying our application data
 	Wt::WComboBox *cbCiphers_;
 	Wt::WText     *keyText_;
 	Wt::WText     *ivText_;
+	Wt::WText     *tagText_;
+	Wt::WProgressBar *progress_; // of background encryption
 	Wt::WTextArea *plainTextEdit_;
 	Wt::WTextArea *cipherTextEdit_;
+	Wt::WTabWidget *plainTextTabs_;
+	Wt::WTabWidget *cipherTextTabs_;
 	Wt::WTableView *plainTextHDView_;
 	Wt::WTableView *cipherTextHDView_;
 	Wt::WPushButton *buttonKey_;
 	Wt::WPushButton *buttonIV_;
 	Wt::WPushButton *buttonEncrypt_;
 	Wt::WPushButton *buttonDecrypt_;
+	Wt::WFileUpload *fileUpload_;
+	Wt::WPushButton *buttonEncryptFile_;
+	Wt::WPushButton *buttonDecryptFile_;
+	Wt::WText     *fileText_;
+	Wt::WTableView *fileHDView_;
+	Wt::WAnchor   *fileAnchor_;
+	Wt::WLineEdit *searchEdit_;   // pattern to find in a hexdump view
+	Wt::WComboBox *searchFormat_; // of searchEdit_: text or hex
+	Wt::WComboBox *searchWhere_;  // plaintext or ciphertext
+	Wt::WText     *searchText_;
+	Wt::WPushButton *buttonFind_;
+
+	std::shared_ptr<DownloadResource> download_file_; // the upload, through the cipher
+
+	// file mode: the upload is spooled to disk by Wt, and streamed
+	// through the cipher into file_out_ by a thread of its own
+	Crypto::Stream::Direction file_dir_ = Crypto::Stream::ENCRYPT;
+	std::string file_out_;
+	Crypto::Bytes file_window_; // first FILE_WINDOW bytes of file_out_
+	std::shared_ptr<std::atomic<bool>> file_cancel_;
+	std::thread file_thread_; // joined by cancelfile()
+	bool file_uploaded_ = false; // the selected file is spooled
+	unsigned file_jobs_ = 0; // for unique output names
+
+	// the payload changed since its text area last showed it
+	bool plaintext_stale_ = false;
+	bool ciphertext_stale_ = false;
 
 	std::map<Wt::WMenuItem *, Wt::WWidget *> mitems_;
 
@@ -80,4 +139,10 @@ private:
 	void create_gui();
 	void connect_signals();
 	void newcipher();
+	void showTexts();
+	void mirror(Wt::WTextArea *edit, std::size_t length, const std::function<const std::string &()> &text);
+	void findnext();
+	void cryptfile();
+	void filedone(const std::string &out, const std::string &error);
+	void cancelfile();
 };
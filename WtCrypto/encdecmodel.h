@@ -21,151 +21,657 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <memory>
-#include <sstream>
-#include <iomanip>
+#include <utility>
+#include <vector>
 
 #include <Wt/WSignal.h>
 
+#include "cipherregistry.h"
 #include "crypto.h"
+#include "hexcodec.h"
+#include "metrics.h"
+#include "threadpool.h"
 
 class EncDecModel
 {
 public:
+	constexpr static std::size_t SPARE_BUFFER_MAX = 1 << 20;
+
+	// plaintexts from this size on are encrypted in the background
+	// (see setPoster()), in at most ASYNC_STEPS chunks of at least
+	// ASYNC_CHUNK bytes, of which at most ASYNC_IN_FLIGHT are on their
+	// way to the model at any time
+	constexpr static std::size_t ASYNC_THRESHOLD = 4 << 20;
+	constexpr static std::size_t ASYNC_CHUNK = 1 << 20;
+	constexpr static std::size_t ASYNC_STEPS = 32;
+	constexpr static std::size_t ASYNC_IN_FLIGHT = 2;
+
 	EncDecModel() :
-		cryptor_(std::make_unique<Crypto>()),
-		ciphers_(Crypto::CipherMap()) {
+		cryptor_(std::make_unique<Crypto>()) {
 		cipherChanged_.connect([=] { setKeyIV(); });
-		keyChanged_.connect([=]() { encrypt(); });
-		ivChanged_.connect([=]() { encrypt(); });
-		keyivChanged_.connect([=]() { encrypt(); });
-		plaintextChanged().connect([=]() { encrypt(); });
+		keyChanged_.connect([=]() { requestEncrypt(); });
+		ivChanged_.connect([=]() { requestEncrypt(); });
+		keyivChanged_.connect([=]() { requestEncrypt(); });
+		plaintextChanged().connect([=]() { requestEncrypt(); });
+		plaintextPatched().connect([=](std::size_t offset, std::size_t count, std::size_t inserted) {
+			requestEncrypt(offset, count, inserted);
+		});
 		// circular calls if you do this:
 		// ciphertextChanged().connect([=]() { decrypt(); });
 	}
 
+	~EncDecModel() {
+		cancelJob();
+	}
+
 	Wt::Signal<std::string>& cipherChanged() { return cipherChanged_; }
 	Wt::Signal<std::string>& keyChanged() { return keyChanged_; }
 	Wt::Signal<std::string>& ivChanged() { return ivChanged_; }
 	Wt::Signal<std::string, std::string>& keyivChanged() { return keyivChanged_; }
-	Wt::Signal<std::string>& plaintextChanged() { return plaintextChanged_; }
-	Wt::Signal<std::string>& ciphertextChanged() { return ciphertextChanged_; }
+	// These carry the new version number of the payload, not the
+	// payload: subscribers all read the same plaintext() / ciphertext().
+	Wt::Signal<std::uint64_t>& plaintextChanged() { return plaintextChanged_; }
+	Wt::Signal<std::uint64_t>& ciphertextChanged() { return ciphertextChanged_; }
+	Wt::Signal<std::string>& tagChanged() { return tagChanged_; }
+
+	// (offset, bytes removed, bytes inserted) of an in-place edit
+	Wt::Signal<std::size_t, std::size_t, std::size_t>& plaintextPatched() { return plaintextPatched_; }
+	Wt::Signal<std::size_t, std::size_t, std::size_t>& ciphertextPatched() { return ciphertextPatched_; }
+
+	// (plaintext bytes done, plaintext size) of a background encryption;
+	// the ciphertext grows as it goes. Both are equal once it's over.
+	Wt::Signal<std::size_t, std::size_t>& encryptProgress() { return encryptProgress_; }
+
+	// Encrypt large plaintexts on the thread pool: post(f) has to run f
+	// later on the thread that owns this model, and may be called from
+	// any thread. Results arrive in chunks through post, as ciphertext
+	// patches. Without a poster, everything is encrypted synchronously.
+	void setPoster(std::function<void(std::function<void()>)> post) { post_ = std::move(post); }
+
+	bool encrypting() const { return job_ != nullptr; }
+
+	// the same for all models: see CipherRegistry
+	const std::vector<CipherRegistry::Entry> &ciphers() const { return CipherRegistry::instance().entries(); }
+
+	// current cipher, key and iv, e.g. for a FileCryptor
+	const Crypto &crypto() const { return *cryptor_; }
+
+	// Changes only mark the ciphertext as out of date; it is encrypted
+	// once when the outermost change is done, however many changes it
+	// caused along the way. Deferred, that waits until the owner calls
+	// flush(), e.g. once at the end of each event.
+	void setDeferred(const bool deferred) { deferred_ = deferred; }
+
+	void flush() {
+		while (pending_ != Pending::NONE) {
+			const Pending pending = pending_;
+			pending_ = Pending::NONE;
+			++stats_.performed;
+			if (pending == Pending::RANGE)
+				encryptRange(dirty_begin_, dirty_to_end_ ? plaintext_->size() : dirty_end_);
+			else
+				encryptAll();
+		}
+	}
+
+	// encryption passes asked for by changes, and actually run
+	struct Stats {
+		std::uint64_t requested = 0;
+		std::uint64_t performed = 0;
 
-	const Crypto::cipher_map_t ciphers() const { return ciphers_; }
+		std::uint64_t avoided() const { return requested - performed; }
+	};
+	const Stats &stats() const { return stats_; }
 
+	// throws std::runtime_error for unknown ciphers, changing nothing
 	void setCipher(const std::string &cipher) {
+		Change change(*this);
 		if (cipher != cipher_str_) {
-			cryptor_->setCipher(ciphers_[cipher]);
+			cryptor_->setCipher(CipherRegistry::instance().at(cipher).cipher);
 			cipher_str_ = cipher;
-			cipherChanged_.emit(cipher);
+			fanout(Metrics::CIPHER_CHANGED, cipherChanged_, cipher);
 		}
+		change.done();
 	}
-	const std::string cipher() const { return cipher_str_; }
+	const std::string &cipher() const { return cipher_str_; }
 
 	void setKey(/* const Crypto::Bytes & newKey */) {
+		Change change(*this);
 		cryptor_->newKey();
-		key_ = cryptor_->key();
-		key_str_ = bytesToHex(key_);
-		keyChanged_.emit(key_str_);
+		key_str_ = bytesToHex(cryptor_->key());
+		fanout(Metrics::KEY_CHANGED, keyChanged_, key_str_);
+		change.done();
 	}
-	const std::string key() const { return key_str_; }
+	const std::string &key() const { return key_str_; }
 
 	void setIV(/* const Crypto::Bytes & newIV */) {
+		Change change(*this);
 		cryptor_->newIV();
-		iv_ = cryptor_->iv();
-		iv_str_ = bytesToHex(iv_);
-		ivChanged_.emit(iv_str_);
+		iv_str_ = bytesToHex(cryptor_->iv());
+		fanout(Metrics::IV_CHANGED, ivChanged_, iv_str_);
+		change.done();
 	}
-	const std::string iv() const { return iv_str_; }
+	const std::string &iv() const { return iv_str_; }
 
 	void setKeyIV() {
 		// set key and iv simultaneously
+		Change change(*this);
 
 		cryptor_->newKey();
-		key_ = cryptor_->key();
-		key_str_ = bytesToHex(key_);
+		key_str_ = bytesToHex(cryptor_->key());
 
 		cryptor_->newIV();
-		iv_ = cryptor_->iv();
-		iv_str_ = bytesToHex(iv_);
+		iv_str_ = bytesToHex(cryptor_->iv());
 
-		keyivChanged_.emit(key_str_, iv_str_);
+		fanout(Metrics::KEYIV_CHANGED, keyivChanged_, key_str_, iv_str_);
+		change.done();
 	}
 
 	void setPlaintext(const Crypto::Bytes &plaintext) {
-		if (plaintext != plaintext_) {
-			plaintext_ = plaintext;
-			plaintext_str_ = Crypto::toString(plaintext_);
-			plaintextChanged_.emit(plaintext_str_);
+		Change change(*this);
+		if (plaintext != *plaintext_) {
+			if (shared(plaintext_))
+				plaintext_ = std::make_shared<Crypto::Bytes>(plaintext);
+			else
+				*plaintext_ = plaintext;
+			invalidate(plaintext_str_, plaintext_str_valid_);
+			fanout(Metrics::PLAINTEXT_CHANGED, plaintextChanged_, ++plaintext_version_);
 		}
+		change.done();
+	}
+	const Crypto::Bytes &plaintext() const { return *plaintext_; }
+	std::uint64_t plaintext_version() const { return plaintext_version_; }
+
+	// Plaintext as text, made on first use after each change, then
+	// patched along with the bytes. Views that never ask for it, e.g.
+	// for payloads too large to show, never pay for it.
+	const std::string &plaintext_str() const {
+		if (!plaintext_str_valid_) {
+			plaintext_str_.assign(plaintext_->begin(), plaintext_->end());
+			plaintext_str_valid_ = true;
+		}
+		return plaintext_str_;
 	}
-	const std::string plaintext_str() const { return plaintext_str_; }
-	const Crypto::Bytes plaintext() const { return plaintext_; }
 
 	void setCiphertext(const Crypto::Bytes &ciphertext) {
+		cancelJob();
+		ciphertext_current_ = false;
 		if (ciphertext != ciphertext_) {
 			ciphertext_ = ciphertext;
-			ciphertext_str_ = bytesToHex(ciphertext_);
-			ciphertextChanged_.emit(ciphertext_str_);
+			invalidate(ciphertext_str_, ciphertext_str_valid_);
+			fanout(Metrics::CIPHERTEXT_CHANGED, ciphertextChanged_, ++ciphertext_version_);
+			updateTag();
 		}
 	}
-	const std::string ciphertext_str() const { return ciphertext_str_; }
-	const Crypto::Bytes ciphertext() const { return ciphertext_; }
 
-	void encrypt() {
-		try {
-			auto ciphertext = cryptor_->encrypt(plaintext_);
-			setCiphertext(ciphertext);
+	const Crypto::Bytes &ciphertext() const { return ciphertext_; }
+	std::uint64_t ciphertext_version() const { return ciphertext_version_; }
+
+	// ciphertext as hex string, the same way
+	const std::string &ciphertext_str() const {
+		if (!ciphertext_str_valid_) {
+			ciphertext_str_ = HexCodec::encode(ciphertext_);
+			ciphertext_str_valid_ = true;
 		}
-		catch (std::runtime_error &e) {
-			auto ciphertext = Crypto::toBytes(e.what());
-			setCiphertext(ciphertext);
+		return ciphertext_str_;
+	}
+
+	// Replace count bytes at offset by replacement, in place. Unlike
+	// setPlaintext() / setCiphertext(), only the patched range has to
+	// be looked at and reformatted, and the *Patched() signals tell
+	// views which range that was.
+	void patchPlaintext(std::size_t offset, std::size_t count, const Crypto::Bytes &replacement) {
+		Change change(*this);
+		if (shared(plaintext_)) {
+			// a background job still reads it: patch a copy, which views
+			// have to look at afresh
+			auto plaintext = std::make_shared<Crypto::Bytes>(*plaintext_);
+			if (patch(*plaintext, offset, count, replacement)) {
+				plaintext_ = std::move(plaintext);
+				invalidate(plaintext_str_, plaintext_str_valid_);
+				fanout(Metrics::PLAINTEXT_CHANGED, plaintextChanged_, ++plaintext_version_);
+			}
+		}
+		else if (patch(*plaintext_, offset, count, replacement)) {
+			if (plaintext_str_valid_)
+				plaintext_str_.replace(offset, count, Crypto::toString(replacement));
+			++plaintext_version_;
+			fanout(Metrics::PLAINTEXT_PATCHED, plaintextPatched_, offset, count, replacement.size());
+		}
+		change.done();
+	}
+
+	void patchCiphertext(std::size_t offset, std::size_t count, const Crypto::Bytes &replacement) {
+		cancelJob();
+		ciphertext_current_ = false;
+		if (patch(ciphertext_, offset, count, replacement)) {
+			if (ciphertext_str_valid_)
+				ciphertext_str_.replace(2 * offset, 2 * count, bytesToHex(replacement));
+			++ciphertext_version_;
+			fanout(Metrics::CIPHERTEXT_PATCHED, ciphertextPatched_, offset, count, replacement.size());
+			updateTag();
 		}
 	}
 
+	// AEAD ciphers: authentication tag at the end of the ciphertext,
+	// as hex string. Empty for all other ciphers.
+	const std::string &tag() const { return tag_str_; }
+
+	// encrypt right away; that covers any pending change, too
+	void encrypt() {
+		++stats_.requested;
+		++stats_.performed;
+		pending_ = Pending::NONE;
+		encryptAll();
+	}
+
 	void decrypt() {
+		Change change(*this);
+		cancelJob();
 		try {
-			auto plaintext = cryptor_->decrypt(ciphertext_);
-			setPlaintext(plaintext);
+			buffer_.resize(cryptor_->plaintext_size(ciphertext_.size()));
+			buffer_.resize(cryptor_->decrypt(ciphertext_, buffer_));
+			swapPlaintext(buffer_);
+			trimBuffer();
 		}
 		catch (std::runtime_error &e) {
 			auto plaintext = Crypto::toBytes(e.what());
 			setPlaintext(plaintext);
 		}
+		change.done();
 	}
 
 private:
+	// Open while a public member function changes the model; the
+	// outermost one runs the pending encryption in done(), at the end
+	// of the change. Not from the destructor: flush() runs slots, and
+	// what they throw must not leave a destructor. A change left by an
+	// exception keeps its encryption pending, for the next flush().
+	class Change {
+	public:
+		explicit Change(EncDecModel &model) : model_(model) { ++model_.depth_; }
+		~Change() {
+			if (!done_)
+				--model_.depth_;
+		}
+
+		void done() {
+			done_ = true;
+			if (--model_.depth_ == 0 && !model_.deferred_)
+				model_.flush();
+		}
+
+	private:
+		EncDecModel &model_;
+		bool done_ = false;
+	};
+
+	// emit signal, timing the slots it runs
+	template <typename... A, typename... Args>
+	static void fanout(const Metrics::Event event, const Wt::Signal<A...> &signal, Args &&... args) {
+		Metrics::Timer timer(event);
+		signal.emit(std::forward<Args>(args)...);
+	}
+
+	enum class Pending { NONE, RANGE, ALL };
+
+	void requestEncrypt() {
+		++stats_.requested;
+		pending_ = Pending::ALL;
+	}
+
+	// plaintext_ patched: count bytes at offset replaced by inserted
+	// bytes; merged with what is already pending
+	void requestEncrypt(std::size_t offset, std::size_t count, std::size_t inserted) {
+		++stats_.requested;
+		switch (pending_) {
+		case Pending::ALL:
+			return;
+		case Pending::NONE:
+			pending_ = Pending::RANGE;
+			dirty_begin_ = offset;
+			dirty_end_ = offset + inserted;
+			dirty_to_end_ = count != inserted;
+			return;
+		case Pending::RANGE:
+			dirty_begin_ = std::min(dirty_begin_, offset);
+			dirty_end_ = std::max(dirty_end_, offset + inserted);
+			dirty_to_end_ = dirty_to_end_ || count != inserted; // the rest moved
+			return;
+		}
+	}
+
+	void encryptAll() {
+		cancelJob();
+		try {
+			if (post_ && plaintext_->size() >= ASYNC_THRESHOLD) {
+				Crypto::check_size(cryptor_->cipher(), plaintext_->size()); // before the job starts
+				startJob();
+				return;
+			}
+
+			// encrypt straight into our spare buffer, then swap it in
+			buffer_.resize(cryptor_->ciphertext_size(plaintext_->size()));
+			buffer_.resize(cryptor_->encrypt(*plaintext_, buffer_));
+			swapCiphertext(buffer_);
+			ciphertext_current_ = true;
+			trimBuffer();
+		}
+		catch (std::runtime_error &e) {
+			auto ciphertext = Crypto::toBytes(e.what());
+			setCiphertext(ciphertext);
+			setTag(std::string()); // error message has no tag
+		}
+	}
+
+	// After plaintext_[offset, end) was patched: re-encrypt only the
+	// blocks that depend on it, if the cipher mode allows that.
+	void encryptRange(std::size_t offset, std::size_t end) {
+		Crypto::Patch patch;
+
+		try {
+			if (!ciphertext_current_ ||
+				!cryptor_->reencrypt(*plaintext_, offset, end, ciphertext_, &patch)) {
+				encryptAll();
+				return;
+			}
+		}
+		catch (std::runtime_error &) {
+			encryptAll(); // start over, and report the error from there
+			return;
+		}
+
+		if (ciphertext_str_valid_)
+			ciphertext_str_.replace(2 * patch.offset, 2 * patch.removed,
+				HexCodec::encode(ciphertext_.data() + patch.offset, patch.inserted));
+		++ciphertext_version_;
+		fanout(Metrics::CIPHERTEXT_PATCHED, ciphertextPatched_, patch.offset, patch.removed, patch.inserted);
+		updateTag();
+	}
+
+	// A background encryption. The worker reads the plaintext it shares
+	// with the model, which copies it before any change while the job
+	// holds it (see shared()). Each chunk of ciphertext goes to the
+	// model's thread in a piece of its own, to be appended there, as
+	// long as the job is current; the worker waits while ASYNC_IN_FLIGHT
+	// of them haven't arrived yet, so that the ciphertext exists about
+	// once. It stops early once cancelled.
+	struct Job {
+		std::atomic<bool> cancelled{ false };
+		std::mutex mutex;
+		std::condition_variable arrived; // a piece, or cancelled
+		std::size_t in_flight = 0; // pieces posted, not appended yet
+	};
+
+	void startJob() {
+		auto job = std::make_shared<Job>();
+		job_ = job;
+
+		// the ciphertext starts over empty, and grows with the job
+		if (!ciphertext_.empty()) {
+			Crypto::Bytes().swap(ciphertext_);
+			invalidate(ciphertext_str_, ciphertext_str_valid_);
+			fanout(Metrics::CIPHERTEXT_CHANGED, ciphertextChanged_, ++ciphertext_version_);
+		}
+		ciphertext_current_ = false;
+		setTag(std::string());
+
+		const std::size_t n = plaintext_->size();
+		ciphertext_.reserve(cryptor_->ciphertext_size(n));
+		const std::shared_ptr<const Crypto::Bytes> plaintext = plaintext_;
+		const EVP_CIPHER *cipher = cryptor_->cipher();
+		const Crypto::Bytes key = cryptor_->key();
+		const Crypto::Bytes iv = cryptor_->iv();
+		const std::size_t taglen = cryptor_->tag_length();
+		const auto post = post_;
+		EncDecModel *self = this;
+
+		fanout(Metrics::ENCRYPT_PROGRESS, encryptProgress_, 0, n);
+
+		ThreadPool::background().submit([=]() {
+			try {
+				// same steps as Crypto::encrypt(), a chunk at a time
+				Metrics::CryptoTimer timer(cipher, Metrics::ENCRYPT, n);
+				Crypto::Stream enc(cipher, key, iv, Crypto::Stream::ENCRYPT);
+				enc.begin();
+				std::size_t chunk = n / ASYNC_STEPS;
+				if (chunk < ASYNC_CHUNK)
+					chunk = ASYNC_CHUNK;
+				if (EVP_CIPHER_mode(cipher) == EVP_CIPH_XTS_MODE)
+					chunk = n; // XTS takes the whole message in one go
+
+				std::size_t done = 0;
+				while (done < n) {
+					{
+						std::unique_lock<std::mutex> lock(job->mutex);
+						job->arrived.wait(lock, [&] { return job->cancelled || job->in_flight < ASYNC_IN_FLIGHT; });
+						if (job->cancelled)
+							return;
+						++job->in_flight;
+					}
+					const std::size_t len = std::min(chunk, n - done);
+					auto piece = std::make_shared<Crypto::Bytes>(len + EVP_MAX_BLOCK_LENGTH);
+					piece->resize(enc.update(Crypto::ConstSpan(plaintext->data() + done, len), Crypto::Span(*piece)));
+					done += len;
+					post([=]() { if (!job->cancelled) self->jobProgress(job, done, *piece); });
+				}
+				auto last = std::make_shared<Crypto::Bytes>(EVP_MAX_BLOCK_LENGTH + taglen);
+				std::size_t outl = enc.finish(Crypto::Span(*last));
+				if (taglen != 0) {
+					enc.get_tag(Crypto::Span(last->data() + outl, taglen));
+					outl += taglen;
+				}
+				last->resize(outl);
+				post([=]() { if (!job->cancelled) self->jobDone(job, *last, std::string()); });
+			}
+			catch (std::runtime_error &e) {
+				const std::string error = e.what();
+				post([=]() { if (!job->cancelled) self->jobDone(job, Crypto::Bytes(), error); });
+			}
+		});
+	}
+
+	// the ciphertext of the plaintext up to done goes on with piece
+	void jobProgress(const std::shared_ptr<Job> &job, std::size_t done, const Crypto::Bytes &piece) {
+		if (job != job_)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(job->mutex);
+			--job->in_flight;
+		}
+		job->arrived.notify_one();
+		const std::size_t old_size = ciphertext_.size();
+		ciphertext_.insert(ciphertext_.end(), piece.begin(), piece.end());
+		ciphertextGrew(old_size);
+		fanout(Metrics::ENCRYPT_PROGRESS, encryptProgress_, done, plaintext_->size());
+	}
+
+	// the last piece: the final block and the tag
+	void jobDone(const std::shared_ptr<Job> &job, const Crypto::Bytes &last, const std::string &error) {
+		if (job != job_)
+			return;
+		job_.reset();
+
+		if (!error.empty()) {
+			setCiphertext(Crypto::toBytes(error));
+			setTag(std::string());
+		}
+		else {
+			const std::size_t old_size = ciphertext_.size();
+			ciphertext_.insert(ciphertext_.end(), last.begin(), last.end());
+			ciphertext_current_ = true;
+			ciphertextGrew(old_size);
+			updateTag();
+		}
+		fanout(Metrics::ENCRYPT_PROGRESS, encryptProgress_, plaintext_->size(), plaintext_->size());
+	}
+
+	void ciphertextGrew(std::size_t old_size) {
+		const std::size_t added = ciphertext_.size() - old_size;
+		if (added == 0)
+			return;
+		if (ciphertext_str_valid_)
+			ciphertext_str_ += HexCodec::encode(ciphertext_.data() + old_size, added);
+		++ciphertext_version_;
+		fanout(Metrics::CIPHERTEXT_PATCHED, ciphertextPatched_, old_size, 0, added);
+	}
+
+	void cancelJob() {
+		if (job_) {
+			{
+				std::lock_guard<std::mutex> lock(job_->mutex);
+				job_->cancelled = true;
+			}
+			job_->arrived.notify_one();
+			job_.reset();
+		}
+	}
+
+	// Like setPlaintext() / setCiphertext(), but take over the contents
+	// of buf and hand back the previous storage in it for reuse, so
+	// that repeated encryption does not allocate.
+	void swapPlaintext(Crypto::Bytes &buf) {
+		if (buf != *plaintext_) {
+			if (shared(plaintext_))
+				plaintext_ = std::make_shared<Crypto::Bytes>();
+			plaintext_->swap(buf);
+			invalidate(plaintext_str_, plaintext_str_valid_);
+			fanout(Metrics::PLAINTEXT_CHANGED, plaintextChanged_, ++plaintext_version_);
+		}
+	}
+
+	void swapCiphertext(Crypto::Bytes &buf) {
+		if (buf != ciphertext_) {
+			ciphertext_.swap(buf);
+			invalidate(ciphertext_str_, ciphertext_str_valid_);
+			fanout(Metrics::CIPHERTEXT_CHANGED, ciphertextChanged_, ++ciphertext_version_);
+			updateTag();
+		}
+	}
+
+	// Replace buf[offset, offset + count) by replacement; false if
+	// that would not change anything.
+	static bool patch(Crypto::Bytes &buf, std::size_t &offset, std::size_t &count,
+		const Crypto::Bytes &replacement) {
+		offset = std::min(offset, buf.size());
+		count = std::min(count, buf.size() - offset);
+
+		if (count == replacement.size()) {
+			if (std::equal(replacement.begin(), replacement.end(), buf.begin() + offset))
+				return false;
+			std::copy(replacement.begin(), replacement.end(), buf.begin() + offset);
+		}
+		else {
+			// only the tail moves
+			const auto first = buf.begin() + offset;
+			if (count > replacement.size())
+				buf.erase(first + replacement.size(), first + count);
+			else
+				buf.insert(first + count, replacement.begin() + count, replacement.end());
+			std::copy(replacement.begin(), replacement.begin() + std::min(count, replacement.size()),
+				buf.begin() + offset);
+		}
+		return true;
+	}
+
+	// buf is still read by a background job, and must not be changed
+	// in place. A stale count only costs a copy.
+	static bool shared(const std::shared_ptr<Crypto::Bytes> &buf) {
+		return buf.use_count() > 1;
+	}
+
+	// The spare buffer holds the previous plaintext / ciphertext; only
+	// keep it around for payloads small enough not to matter.
+	void trimBuffer() {
+		if (buffer_.capacity() > SPARE_BUFFER_MAX)
+			Crypto::Bytes().swap(buffer_);
+	}
+
+	// drop a cached text representation, and its memory
+	static void invalidate(std::string &cache, bool &valid) {
+		std::string().swap(cache);
+		valid = false;
+	}
+
+	void updateTag() {
+		const std::size_t taglen = cryptor_->tag_length();
+		if (taglen != 0 && ciphertext_.size() >= taglen)
+			setTag(bytesToHex(Crypto::Bytes(ciphertext_.end() - taglen, ciphertext_.end())));
+		else
+			setTag(std::string());
+	}
+
+	void setTag(const std::string &tag) {
+		if (tag != tag_str_) {
+			tag_str_ = tag;
+			fanout(Metrics::TAG_CHANGED, tagChanged_, tag_str_);
+		}
+	}
+
 	std::string bytesToHex(const Crypto::Bytes &input) {
-		std::ostringstream oss;
-		for (const auto &c : input)
-			oss << std::hex << std::setw(2) << std::setfill('0')
-				<< static_cast<unsigned int>(c);
-		return oss.str();
+		return HexCodec::encode(input);
 	}
 
 private:
 	std::unique_ptr<Crypto> cryptor_;
-	Crypto::cipher_map_t ciphers_;
 
 	std::string cipher_str_; // name of current cipher
 
-	Crypto::Bytes key_;
 	std::string key_str_; // key as hex string
-
-	Crypto::Bytes iv_;
 	std::string iv_str_; // IV as hex string
 
-	Crypto::Bytes plaintext_;
-	std::string plaintext_str_;
+	// The byte buffers are the payloads proper; their text and hex
+	// forms are only made when asked for, and kept up to date from then
+	// on, until a change replaces the payload as a whole.
+	// A background job shares plaintext_ (copy on write, see shared()).
+	std::shared_ptr<Crypto::Bytes> plaintext_ = std::make_shared<Crypto::Bytes>();
+	mutable std::string plaintext_str_;
+	mutable bool plaintext_str_valid_ = false;
+	std::uint64_t plaintext_version_ = 0; // bumped on every change
 
 	Crypto::Bytes ciphertext_;
-	std::string ciphertext_str_;
+	mutable std::string ciphertext_str_;
+	mutable bool ciphertext_str_valid_ = false;
+	std::uint64_t ciphertext_version_ = 0;
+
+	std::string tag_str_; // AEAD tag as hex string
+
+	// ciphertext_ is the encryption of plaintext_ with the current
+	// cipher, key and IV, and can be patched along with it
+	bool ciphertext_current_ = false;
+
+	Crypto::Bytes buffer_; // spare output buffer for encrypt() / decrypt()
+
+	// encryption still to be done by flush(): none, of the dirty
+	// range of plaintext_ (up to its end, if anything moved), or all
+	Pending pending_ = Pending::NONE;
+	std::size_t dirty_begin_ = 0;
+	std::size_t dirty_end_ = 0;
+	bool dirty_to_end_ = false;
+
+	std::function<void(std::function<void()>)> post_; // to this model's thread
+	std::shared_ptr<Job> job_; // current background encryption, if any
+
+	int depth_ = 0; // of nested Change scopes
+	bool deferred_ = false;
+	Stats stats_;
 
 	Wt::Signal<std::string> cipherChanged_;
 	Wt::Signal<std::string> keyChanged_;
 	Wt::Signal<std::string> ivChanged_;
 	Wt::Signal<std::string, std::string> keyivChanged_;
-	Wt::Signal<std::string> plaintextChanged_;
-	Wt::Signal<std::string> ciphertextChanged_;
+	Wt::Signal<std::uint64_t> plaintextChanged_;
+	Wt::Signal<std::uint64_t> ciphertextChanged_;
+	Wt::Signal<std::string> tagChanged_;
+	Wt::Signal<std::size_t, std::size_t, std::size_t> plaintextPatched_;
+	Wt::Signal<std::size_t, std::size_t, std::size_t> ciphertextPatched_;
+	Wt::Signal<std::size_t, std::size_t> encryptProgress_;
 };
\ No newline at end of file
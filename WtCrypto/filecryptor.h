@@ -0,0 +1,235 @@
+// filecryptor.h -- Encrypt / decrypt files chunk by chunk
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "crypto.h"
+
+/*
+* A read-only file, accessed a range at a time: memory-mapped where
+* the platform allows it (no copies, the page cache does the
+* buffering), read into a buffer of its own otherwise.
+*/
+class InputFile
+{
+public:
+	explicit InputFile(const std::string &path) :
+		stream_(path, std::ios::binary) {
+		if (!stream_)
+			throw std::runtime_error("Can't open " + path);
+		stream_.seekg(0, std::ios::end);
+		size_ = static_cast<std::uint64_t>(stream_.tellg());
+		stream_.seekg(0);
+		map(path);
+	}
+
+	~InputFile() {
+#if !defined(_WIN32)
+		if (map_ != nullptr)
+			munmap(map_, static_cast<std::size_t>(size_));
+#endif
+	}
+
+	InputFile(const InputFile &) = delete;
+	InputFile &operator=(const InputFile &) = delete;
+
+	std::uint64_t size() const { return size_; }
+	bool mapped() const { return map_ != nullptr; }
+
+	// bytes [offset, offset + n) of the file, clipped to its end;
+	// valid until the next call
+	Crypto::ConstSpan at(const std::uint64_t offset, std::size_t n) {
+		if (offset >= size_)
+			return Crypto::ConstSpan(nullptr, 0);
+		if (n > size_ - offset)
+			n = static_cast<std::size_t>(size_ - offset);
+
+		if (map_ != nullptr)
+			return Crypto::ConstSpan(static_cast<const unsigned char *>(map_) + offset, n);
+
+		buffer_.resize(n);
+		stream_.seekg(static_cast<std::streamoff>(offset));
+		if (!stream_.read(reinterpret_cast<char *>(buffer_.data()), static_cast<std::streamsize>(n)))
+			throw std::runtime_error("Read error");
+		return Crypto::ConstSpan(buffer_.data(), n);
+	}
+
+	// Ask the kernel to start reading bytes [offset, offset + n) of a
+	// mapped file now, rather than page by page once they're touched.
+	void prefetch(const std::uint64_t offset, std::size_t n) const {
+#if !defined(_WIN32)
+		if (map_ == nullptr || offset >= size_)
+			return;
+		if (n > size_ - offset)
+			n = static_cast<std::size_t>(size_ - offset);
+		const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+		const std::size_t first = static_cast<std::size_t>(offset) / page * page;
+		madvise(static_cast<char *>(map_) + first, static_cast<std::size_t>(offset) - first + n, MADV_WILLNEED);
+#else
+		(void)offset;
+		(void)n;
+#endif
+	}
+
+private:
+	void map(const std::string &path) {
+#if !defined(_WIN32)
+		if (size_ == 0 || size_ > SIZE_MAX)
+			return;
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		void *p = mmap(nullptr, static_cast<std::size_t>(size_), PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return; // fall back to reading
+		madvise(p, static_cast<std::size_t>(size_), MADV_SEQUENTIAL);
+		map_ = p;
+#else
+		(void)path;
+#endif
+	}
+
+	std::ifstream stream_;
+	std::uint64_t size_ = 0;
+	void *map_ = nullptr;
+	Crypto::Bytes buffer_; // unmapped files only
+};
+
+/*
+* Encrypts or decrypts a file into another file, CHUNK bytes at a time,
+* so that memory use does not depend on the size of the file. The
+* output is the same as Crypto::encrypt() / decrypt() of the whole
+* file: for AEAD ciphers, the tag follows the ciphertext.
+*/
+class FileCryptor
+{
+public:
+	constexpr static std::size_t CHUNK = 1 << 20;
+
+	// (bytes of input done, input size); return false to cancel
+	using Progress = std::function<bool(std::uint64_t, std::uint64_t)>;
+
+	explicit FileCryptor(const Crypto &crypto) :
+		cipher_(crypto.cipher()),
+		key_(crypto.key()),
+		iv_(crypto.iv()),
+		taglen_(crypto.tag_length()) {}
+
+	// Return the size of the output file. On errors and when cancelled,
+	// the output file is removed, and std::runtime_error thrown.
+	std::uint64_t encrypt(const std::string &in, const std::string &out, Progress progress = Progress()) {
+		return run(in, out, Crypto::Stream::ENCRYPT, progress);
+	}
+
+	std::uint64_t decrypt(const std::string &in, const std::string &out, Progress progress = Progress()) {
+		return run(in, out, Crypto::Stream::DECRYPT, progress);
+	}
+
+private:
+	std::uint64_t run(const std::string &in_path, const std::string &out_path,
+		const Crypto::Stream::Direction dir, Progress &progress) {
+		try {
+			return crypt(in_path, out_path, dir, progress);
+		}
+		catch (...) {
+			std::remove(out_path.c_str());
+			throw;
+		}
+	}
+
+	std::uint64_t crypt(const std::string &in_path, const std::string &out_path,
+		const Crypto::Stream::Direction dir, Progress &progress) {
+		InputFile in(in_path);
+		// XTS takes the whole file as one data unit: refuse what doesn't
+		// fit, before a buffer that large is allocated
+		Crypto::check_size(cipher_, in.size());
+		Metrics::CryptoTimer timer(cipher_, dir == Crypto::Stream::ENCRYPT ? Metrics::ENCRYPT : Metrics::DECRYPT,
+			static_cast<std::size_t>(in.size()));
+		std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+		if (!out)
+			throw std::runtime_error("Can't create " + out_path);
+
+		// AEAD: when decrypting, the tag is the end of the input
+		std::uint64_t size = in.size();
+		Crypto::Stream stream(cipher_, key_, iv_, dir);
+		stream.begin();
+		if (dir == Crypto::Stream::DECRYPT && taglen_ != 0) {
+			if (size < taglen_)
+				throw std::runtime_error("Ciphertext shorter than authentication tag");
+			size -= taglen_;
+			stream.set_tag(in.at(size, taglen_));
+		}
+
+		// XTS can't be fed piecemeal: one chunk of at most Crypto::XTS_MAX
+		const std::size_t chunk = EVP_CIPHER_mode(cipher_) == EVP_CIPH_XTS_MODE ?
+			static_cast<std::size_t>(size) : CHUNK;
+
+		Crypto::Bytes buffer(chunk + EVP_MAX_BLOCK_LENGTH + taglen_);
+		std::uint64_t done = 0, written = 0;
+		auto write = [&](const std::size_t n) {
+			if (!out.write(reinterpret_cast<const char *>(buffer.data()), static_cast<std::streamsize>(n)))
+				throw std::runtime_error("Write error");
+			written += n;
+		};
+
+		while (done < size) {
+			if (progress && !progress(done, size))
+				throw std::runtime_error("Cancelled");
+			const std::size_t len = size - done < chunk ? static_cast<std::size_t>(size - done) : chunk;
+			write(stream.update(in.at(done, len), Crypto::Span(buffer)));
+			done += len;
+		}
+
+		std::size_t outl = stream.finish(Crypto::Span(buffer)); // checks the tag
+		if (dir == Crypto::Stream::ENCRYPT && taglen_ != 0) {
+			stream.get_tag(Crypto::Span(buffer.data() + outl, taglen_));
+			outl += taglen_;
+		}
+		write(outl);
+
+		out.close();
+		if (!out)
+			throw std::runtime_error("Write error");
+		if (progress)
+			progress(size, size);
+		return written;
+	}
+
+	const EVP_CIPHER *cipher_;
+	Crypto::Bytes key_;
+	Crypto::Bytes iv_;
+	std::size_t taglen_;
+};
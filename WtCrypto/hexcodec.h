@@ -0,0 +1,336 @@
+// hexcodec.h -- Fast hex encoding and decoding
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HEXCODEC_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define HEXCODEC_TARGET(isa)
+#else
+#define HEXCODEC_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+/*
+* Hex encoding (lowercase) and decoding (either case) of byte buffers.
+*
+* Uses AVX2 or SSSE3 kernels when the CPU has them (checked once at
+* runtime), and a table-driven scalar loop otherwise and for the
+* tails. Decoding never produces garbage: the position of the first
+* invalid character is reported instead.
+*/
+class HexCodec
+{
+public:
+	enum class Kernel { Scalar, SSSE3, AVX2 };
+
+	// invalid hex input, at position() (== size for odd-length input)
+	class Error : public std::invalid_argument {
+	public:
+		Error(const std::string &what, const std::size_t position) :
+			std::invalid_argument(what), position_(position) {}
+		std::size_t position() const { return position_; }
+	private:
+		std::size_t position_;
+	};
+
+	static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+	// the fastest kernel this CPU supports
+	static Kernel best() {
+		static const Kernel kernel = detect();
+		return kernel;
+	}
+
+	static const char *name(const Kernel kernel) {
+		switch (kernel) {
+		case Kernel::AVX2:  return "avx2";
+		case Kernel::SSSE3: return "ssse3";
+		default:            return "scalar";
+		}
+	}
+
+	// write 2 * n hex digits to out
+	static void encode(const unsigned char *in, const std::size_t n, char *out,
+		const Kernel kernel = best()) {
+		std::size_t i = 0;
+#ifdef HEXCODEC_X86
+		if (kernel == Kernel::AVX2)
+			i = encode_avx2(in, n, out);
+		else if (kernel == Kernel::SSSE3)
+			i = encode_ssse3(in, n, out);
+#else
+		(void)kernel;
+#endif
+		encode_scalar(in + i, n - i, out + 2 * i);
+	}
+
+	static std::string encode(const unsigned char *in, const std::size_t n) {
+		std::string out(2 * n, '\0');
+		encode(in, n, &out[0]);
+		return out;
+	}
+
+	template <class Container>
+	static std::string encode(const Container &in) {
+		return encode(reinterpret_cast<const unsigned char *>(in.data()), in.size());
+	}
+
+	// Decode nchars (even) hex digits into nchars / 2 bytes at out.
+	// Returns npos on success, or the index of the first invalid
+	// character (out is then only valid up to that pair).
+	static std::size_t decode(const char *in, const std::size_t nchars, unsigned char *out,
+		const Kernel kernel = best()) {
+		std::size_t i = 0;
+#ifdef HEXCODEC_X86
+		if (kernel == Kernel::AVX2)
+			i = decode_avx2(in, nchars, out);
+		else if (kernel == Kernel::SSSE3)
+			i = decode_ssse3(in, nchars, out);
+#else
+		(void)kernel;
+#endif
+		// SIMD kernels stop at the first block with a bad character,
+		// the scalar loop pinpoints it.
+		const std::size_t bad = decode_scalar(in + i, nchars - i, out + i / 2);
+		return bad == npos ? npos : i + bad;
+	}
+
+	// decode a whole string, throws Error on invalid input
+	template <class Bytes = std::vector<unsigned char>>
+	static Bytes decode(const std::string &hex) {
+		if (hex.size() % 2)
+			throw Error("Odd number of hex digits", hex.size());
+
+		Bytes out(hex.size() / 2);
+		const std::size_t bad = decode(hex.data(), hex.size(), out.data());
+		if (bad != npos)
+			throw Error("Invalid hex digit '" + std::string(1, hex[bad]) +
+				"' at position " + std::to_string(bad), bad);
+		return out;
+	}
+
+	// value of one hex digit, or -1
+	static int digit(const char c) {
+		return static_cast<signed char>(decode_table()[static_cast<unsigned char>(c)]);
+	}
+
+	// the two hex digits of byte b are at digit_pairs()[2 * b]
+	static const char *digit_pairs() {
+		return encode_table();
+	}
+
+private:
+	static Kernel detect() {
+#ifdef HEXCODEC_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+		int regs[4];
+		__cpuid(regs, 0);
+		const int max_leaf = regs[0];
+		__cpuid(regs, 1);
+		const bool ssse3 = (regs[2] & (1 << 9)) != 0;
+		const bool osxsave = (regs[2] & (1 << 27)) != 0;
+		bool avx2 = false;
+		if (max_leaf >= 7 && osxsave && (_xgetbv(0) & 0x6) == 0x6) {
+			__cpuidex(regs, 7, 0);
+			avx2 = (regs[1] & (1 << 5)) != 0;
+		}
+		if (avx2)
+			return Kernel::AVX2;
+		if (ssse3)
+			return Kernel::SSSE3;
+#else
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return Kernel::AVX2;
+		if (__builtin_cpu_supports("ssse3"))
+			return Kernel::SSSE3;
+#endif
+#endif
+		return Kernel::Scalar;
+	}
+
+	// "000102...feff"
+	static const char *encode_table() {
+		static const struct Table {
+			char t[512];
+			Table() {
+				const char *digits = "0123456789abcdef";
+				for (int i = 0; i != 256; ++i) {
+					t[2 * i] = digits[i >> 4];
+					t[2 * i + 1] = digits[i & 0xf];
+				}
+			}
+		} table;
+		return table.t;
+	}
+
+	// digit value, or 0xff for non-hex characters
+	static const unsigned char *decode_table() {
+		static const struct Table {
+			unsigned char t[256];
+			Table() {
+				for (int i = 0; i != 256; ++i)
+					t[i] = 0xff;
+				for (int i = 0; i != 10; ++i)
+					t['0' + i] = static_cast<unsigned char>(i);
+				for (int i = 0; i != 6; ++i) {
+					t['a' + i] = static_cast<unsigned char>(10 + i);
+					t['A' + i] = static_cast<unsigned char>(10 + i);
+				}
+			}
+		} table;
+		return table.t;
+	}
+
+	static void encode_scalar(const unsigned char *in, const std::size_t n, char *out) {
+		const char *table = encode_table();
+		for (std::size_t i = 0; i != n; ++i) {
+			out[2 * i] = table[2 * in[i]];
+			out[2 * i + 1] = table[2 * in[i] + 1];
+		}
+	}
+
+	static std::size_t decode_scalar(const char *in, const std::size_t nchars, unsigned char *out) {
+		const unsigned char *table = decode_table();
+		for (std::size_t i = 0; i + 1 < nchars; i += 2) {
+			const unsigned char hi = table[static_cast<unsigned char>(in[i])];
+			const unsigned char lo = table[static_cast<unsigned char>(in[i + 1])];
+			if ((hi | lo) & 0x80)
+				return (hi & 0x80) ? i : i + 1;
+			out[i / 2] = static_cast<unsigned char>((hi << 4) | lo);
+		}
+		return npos;
+	}
+
+#ifdef HEXCODEC_X86
+	// Returns the number of input bytes consumed (a multiple of 16).
+	HEXCODEC_TARGET("ssse3")
+	static std::size_t encode_ssse3(const unsigned char *in, const std::size_t n, char *out) {
+		const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+			'8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+		const __m128i mask = _mm_set1_epi8(0x0f);
+		std::size_t i = 0;
+		for (; i + 16 <= n; i += 16) {
+			const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+			const __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+			const __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(x, mask));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+		}
+		return i;
+	}
+
+	// Returns the number of input bytes consumed (a multiple of 32).
+	HEXCODEC_TARGET("avx2")
+	static std::size_t encode_avx2(const unsigned char *in, const std::size_t n, char *out) {
+		const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+			'8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+			'0', '1', '2', '3', '4', '5', '6', '7',
+			'8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+		const __m256i mask = _mm256_set1_epi8(0x0f);
+		std::size_t i = 0;
+		for (; i + 32 <= n; i += 32) {
+			const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+			const __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+			const __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(x, mask));
+			// unpack works per 128-bit lane: reorder the lanes afterwards
+			const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+			const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+		}
+		return i;
+	}
+
+	// 16 hex characters to 16 nibble values; valid: all 16 were hex
+	HEXCODEC_TARGET("ssse3")
+	static __m128i nibbles_ssse3(const __m128i c, bool &valid) {
+		const __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+		const __m128i a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+		// unsigned d <= 9, unsigned a <= 5
+		const __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+		const __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+		valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) == 0xffff;
+		return _mm_or_si128(_mm_and_si128(is_digit, d),
+			_mm_and_si128(is_alpha, _mm_add_epi8(a, _mm_set1_epi8(10))));
+	}
+
+	// Returns the number of characters decoded (a multiple of 32),
+	// stopping before the first block with an invalid character.
+	HEXCODEC_TARGET("ssse3")
+	static std::size_t decode_ssse3(const char *in, const std::size_t nchars, unsigned char *out) {
+		const __m128i weights = _mm_set1_epi16(0x0110); // hi * 16 + lo * 1
+		std::size_t i = 0;
+		for (; i + 32 <= nchars; i += 32) {
+			bool valid0, valid1;
+			const __m128i n0 = nibbles_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), valid0);
+			const __m128i n1 = nibbles_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i + 16)), valid1);
+			if (!(valid0 && valid1))
+				break;
+			const __m128i b0 = _mm_maddubs_epi16(n0, weights);
+			const __m128i b1 = _mm_maddubs_epi16(n1, weights);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i / 2), _mm_packus_epi16(b0, b1));
+		}
+		return i;
+	}
+
+	HEXCODEC_TARGET("avx2")
+	static __m256i nibbles_avx2(const __m256i c, bool &valid) {
+		const __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+		const __m256i a = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+		const __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+		const __m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+		valid = _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) == -1;
+		return _mm256_or_si256(_mm256_and_si256(is_digit, d),
+			_mm256_and_si256(is_alpha, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+	}
+
+	// Returns the number of characters decoded (a multiple of 64).
+	HEXCODEC_TARGET("avx2")
+	static std::size_t decode_avx2(const char *in, const std::size_t nchars, unsigned char *out) {
+		const __m256i weights = _mm256_set1_epi16(0x0110);
+		std::size_t i = 0;
+		for (; i + 64 <= nchars; i += 64) {
+			bool valid0, valid1;
+			const __m256i n0 = nibbles_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i)), valid0);
+			const __m256i n1 = nibbles_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i + 32)), valid1);
+			if (!(valid0 && valid1))
+				break;
+			const __m256i b0 = _mm256_maddubs_epi16(n0, weights);
+			const __m256i b1 = _mm256_maddubs_epi16(n1, weights);
+			// packus works per 128-bit lane: restore the qword order
+			const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(b0, b1), 0xd8);
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i / 2), packed);
+		}
+		return i;
+	}
+#endif
+};
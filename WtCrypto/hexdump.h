@@ -21,14 +21,17 @@
 
 #pragma once
 
-#include <list>
+#include <algorithm>
+#include <vector>
 #include <string>
-#include <iomanip>
 #include <sstream>
 #include <cctype>
+#include <cstring>
 #include <cassert>
 
-template <class Container = std::list<std::string>>
+#include "hexcodec.h"
+
+template <class Container = std::vector<std::string>>
 class HexDump
 {
 public:
@@ -45,7 +48,10 @@ public:
 		address_width_(address_width),
 		sep_char_(sep_char),
 		sep_col_(sep_col),
-		sep_print_(sep_print) {}
+		sep_print_(sep_print) {
+		assert(chars_per_col_ > 0);
+		make_template();
+	}
 
 	Lines toaddr(const std::string &input);
 	Lines tohex(const std::string &input);
@@ -57,12 +63,35 @@ public:
 
 	std::string dump(const std::string &input);
 
+	// Single-pass dump into caller-owned memory of dump_size(n) bytes.
+	// Returns the number of characters written (== dump_size(n)).
+	// Addresses start at base: a large input can be dumped in pieces
+	// of whole lines.
+	std::size_t dump(const unsigned char *input, std::size_t n, char *out,
+		std::size_t base = 0) const;
+	std::size_t dump_size(std::size_t n, std::size_t base = 0) const;
+
+	// Parts of a single line, for bytes input[0, n), n <= bytes_per_line().
+	// Each writes to out and returns the number of characters written.
+	std::size_t bytes_per_line() const { return 2 * chars_per_col_; }
+	std::size_t addr_size(std::size_t addr) const;
+	std::size_t hex_size() const { return hex_width_; }
+	std::size_t hex_pos(std::size_t i) const { return hex_pos_[i]; } // of byte i, in hex_size()
+	std::size_t format_addr(std::size_t addr, char *out) const;
+	std::size_t format_hex(const unsigned char *input, std::size_t n, char *out) const;
+	std::size_t format_print(const unsigned char *input, std::size_t n, char *out) const;
+
 protected:
 	std::string lines_to_string(const Lines &addrlines, const Lines &hexlines, const Lines &printlines);
 
 private:
-	std::string char_to_hex(const unsigned char c);
-	char char_to_print(const unsigned char c);
+	void make_template();
+
+	template <unsigned int CPC>
+	std::size_t dump_lines(const unsigned char *input, std::size_t n, char *out,
+		std::size_t base) const;
+
+	static const char *print_table();
 
 	unsigned int chars_per_col_;
 	bool show_addresses_;
@@ -70,17 +99,188 @@ private:
 	std::string sep_char_;
 	std::string sep_col_;
 	std::string sep_print_;
+
+	// Layout of a full line after the address: hex codes and their
+	// separators, sep_print, printable chars, newline. hex_pos_[i] is
+	// where the hex code of the i-th byte goes.
+	std::string template_;
+	std::vector<std::size_t> hex_pos_;
+	std::size_t hex_width_;
+	std::size_t print_pos_;
 };
 
 template <class Container>
-std::string HexDump<Container>::dump(const std::string &input)
+void HexDump<Container>::make_template()
+{
+	const std::size_t bpl = bytes_per_line();
+
+	template_.clear();
+	hex_pos_.clear();
+	for (std::size_t i = 0; i != bpl; ++i) {
+		if (i == chars_per_col_)
+			template_ += sep_col_;
+		else if (i != 0)
+			template_ += sep_char_;
+		hex_pos_.push_back(template_.size());
+		template_ += "  ";
+	}
+	hex_width_ = template_.size();
+	template_ += sep_print_;
+	print_pos_ = template_.size();
+	template_ += std::string(bpl, ' ');
+	template_ += '\n';
+}
+
+template <class Container>
+std::size_t HexDump<Container>::addr_size(std::size_t addr) const
+{
+	std::size_t digits = 1;
+	while (addr >>= 4)
+		++digits;
+	return digits > address_width_ ? digits : address_width_;
+}
+
+template <class Container>
+std::size_t HexDump<Container>::format_addr(std::size_t addr, char *out) const
+{
+	static const char digits[] = "0123456789abcdef";
+	const std::size_t len = addr_size(addr);
+	for (std::size_t i = len; i-- > 0; addr >>= 4)
+		out[i] = digits[addr & 0xf];
+	return len;
+}
+
+template <class Container>
+std::size_t HexDump<Container>::format_hex(const unsigned char *input, std::size_t n, char *out) const
+{
+	assert(n <= bytes_per_line());
+	if (n == 0)
+		return 0;
+
+	// hex codes with separators, then spaces up to the full width
+	const std::size_t used = hex_pos_[n - 1] + 2;
+	std::memcpy(out, template_.data(), used);
+	std::memset(out + used, ' ', hex_width_ - used);
+
+	const char *pairs = HexCodec::digit_pairs();
+	for (std::size_t i = 0; i != n; ++i)
+		std::memcpy(out + hex_pos_[i], pairs + 2 * input[i], 2);
+	return hex_width_;
+}
+
+template <class Container>
+std::size_t HexDump<Container>::format_print(const unsigned char *input, std::size_t n, char *out) const
 {
-	auto linesaddr = toaddr(input);
-	auto lineshex = tohex(input);
-	auto linesprint = toprint(input);
+	const char *table = print_table();
+	for (std::size_t i = 0; i != n; ++i)
+		out[i] = table[input[i]];
+	return n;
+}
 
-	auto out = lines_to_string(linesaddr, lineshex, linesprint);
+template <class Container>
+std::size_t HexDump<Container>::dump_size(std::size_t n, std::size_t base) const
+{
+	if (n == 0)
+		return 0;
+
+	const std::size_t bpl = bytes_per_line();
+	const std::size_t nlines = (n + bpl - 1) / bpl;
+	std::size_t size = nlines * (hex_width_ + sep_print_.size() + 1) + n;
+
+	if (show_addresses_) {
+		// addresses are at least address_width_ digits wide, plus a blank
+		size += nlines * (address_width_ + 1);
+		const std::size_t last = base + (nlines - 1) * bpl;
+		for (std::size_t digits = address_width_; digits < 2 * sizeof(std::size_t); ++digits) {
+			const std::size_t limit = std::size_t(1) << (4 * digits);
+			if (last < limit)
+				break;
+			// lines at or above limit need one more digit
+			size += limit <= base ? nlines : nlines - (limit - base + bpl - 1) / bpl;
+		}
+	}
+	return size;
+}
 
+template <class Container>
+std::size_t HexDump<Container>::dump(const unsigned char *input, std::size_t n, char *out,
+	std::size_t base) const
+{
+	// layouts known at compile time let the compiler unroll each line
+	switch (chars_per_col_) {
+	case 4:  return dump_lines<4>(input, n, out, base);
+	case 8:  return dump_lines<8>(input, n, out, base);
+	case 16: return dump_lines<16>(input, n, out, base);
+	default: return dump_lines<0>(input, n, out, base);
+	}
+}
+
+template <class Container>
+template <unsigned int CPC>
+std::size_t HexDump<Container>::dump_lines(const unsigned char *input, std::size_t n, char *out,
+	std::size_t base) const
+{
+	const std::size_t bpl = CPC != 0 ? 2 * CPC : bytes_per_line();
+	const char *pairs = HexCodec::digit_pairs();
+	const char *printable = print_table();
+	const char *tmpl = template_.data();
+	const std::size_t tmpl_size = template_.size();
+	const std::size_t *hex_pos = hex_pos_.data();
+	char *p = out;
+
+	std::size_t addr = 0;
+	for (; addr + bpl <= n; addr += bpl) {
+		if (show_addresses_) {
+			p += format_addr(base + addr, p);
+			*p++ = ' ';
+		}
+		const unsigned char *line = input + addr;
+		std::memcpy(p, tmpl, tmpl_size);
+		for (std::size_t i = 0; i != bpl; ++i)
+			std::memcpy(p + hex_pos[i], pairs + 2 * line[i], 2);
+		for (std::size_t i = 0; i != bpl; ++i)
+			p[print_pos_ + i] = printable[line[i]];
+		p += tmpl_size;
+	}
+
+	if (addr != n) {
+		// incomplete last line
+		const std::size_t rest = n - addr;
+		if (show_addresses_) {
+			p += format_addr(base + addr, p);
+			*p++ = ' ';
+		}
+		p += format_hex(input + addr, rest, p);
+		std::memcpy(p, sep_print_.data(), sep_print_.size());
+		p += sep_print_.size();
+		p += format_print(input + addr, rest, p);
+		*p++ = '\n';
+	}
+
+	return p - out;
+}
+
+template <class Container>
+const char *HexDump<Container>::print_table()
+{
+	static const struct Table {
+		char t[256];
+		Table() {
+			for (int c = 0; c != 256; ++c)
+				t[c] = std::isprint(c) ? static_cast<char>(c) : '.';
+		}
+	} table;
+	return table.t;
+}
+
+template <class Container>
+std::string HexDump<Container>::dump(const std::string &input)
+{
+	std::string out(dump_size(input.size()), '\0');
+	const std::size_t len = dump(reinterpret_cast<const unsigned char *>(input.data()),
+		input.size(), &out[0]);
+	assert(len == out.size());
+	(void)len;
 	return out;
 }
 
@@ -88,12 +288,11 @@ template <class Container>
 typename HexDump<Container>::Lines HexDump<Container>::toaddr(const std::string &input)
 {
 	Lines result;
-	std::ostringstream oss;
 
-	for (std::size_t addr = 0; addr < input.size(); addr += (2 * chars_per_col_)) {
-		oss << std::setw(address_width_) << std::setfill('0') << std::hex << addr;
-		result.push_back(oss.str());
-		oss.str("");
+	for (std::size_t addr = 0; addr < input.size(); addr += bytes_per_line()) {
+		std::string line(addr_size(addr), '0');
+		format_addr(addr, &line[0]);
+		result.push_back(std::move(line));
 	}
 
 	return result;
@@ -103,33 +302,13 @@ template <class Container>
 typename HexDump<Container>::Lines HexDump<Container>::tohex(const std::string & input)
 {
 	Lines result;
-	std::ostringstream oss;
-
-	for (std::size_t i = 0; i != input.size(); ++i) {
-		if ((i > 0) && (i % (2 * chars_per_col_) == 0)) {
-			// start a new line
-			result.push_back(oss.str());
-			oss.str("");
-		}
-		else if ((i > 0) && (i % chars_per_col_ == 0))
-			// start second column
-			oss << sep_col_;
-		else if (i % chars_per_col_ != 0)
-			// prepare to output next hex code
-			oss << sep_char_;
-
-		oss << char_to_hex(input[i]);
-	}
+	const unsigned char *in = reinterpret_cast<const unsigned char *>(input.data());
 
-	if (input.size() != 0) {
-		// output incomplete last line
-		std::size_t nspaces = (4 * chars_per_col_ /* 2 chars per hex on 2 columns */
-			+ 2 * chars_per_col_*sep_char_.size() /* 1 separator per hex on 2 columns */
-			- 2 * sep_char_.size() /* excluding separator for last hex, on 2 columns */
-			+ sep_col_.size() /* including column separator */
-			- oss.str().size() /* but excluding already generated content */);
-		oss << std::string(nspaces, ' ');
-		result.push_back(oss.str());
+	for (std::size_t addr = 0; addr < input.size(); addr += bytes_per_line()) {
+		const std::size_t n = std::min(bytes_per_line(), input.size() - addr);
+		std::string line(hex_width_, ' ');
+		format_hex(in + addr, n, &line[0]);
+		result.push_back(std::move(line));
 	}
 
 	return result;
@@ -139,17 +318,9 @@ template <class Container>
 typename HexDump<Container>::Lines HexDump<Container>::toprint(const std::string & input)
 {
 	Lines result;
-	std::ostringstream oss;
 
-	for (std::size_t i = 0; i != input.size(); ++i) {
-		if ((i > 0) && (i % (2 * chars_per_col_) == 0)) {
-			result.push_back(oss.str());
-			oss.str("");
-		}
-		oss << char_to_print(input[i]);
-	}
-	if (input.size() != 0)
-		result.push_back(oss.str());
+	for (std::size_t addr = 0; addr < input.size(); addr += bytes_per_line())
+		result.push_back(toprintline(input.substr(addr, bytes_per_line())));
 
 	return result;
 }
@@ -157,30 +328,46 @@ typename HexDump<Container>::Lines HexDump<Container>::toprint(const std::string
 template <class Container>
 std::string HexDump<Container>::toprintline(const std::string &input)
 {
-	std::ostringstream oss;
-	for (const auto &c : input)
-		oss << char_to_print(c);
-	return oss.str();
+	std::string out(input.size(), ' ');
+	format_print(reinterpret_cast<const unsigned char *>(input.data()), input.size(), &out[0]);
+	return out;
 }
 
 template <class Container>
 std::string HexDump<Container>::fromhex(const std::string &hexline)
 {
-	std::ostringstream oss;
-	std::istringstream iss(hexline);
-	unsigned int c;
-	while (iss >> std::hex >> c)
-		oss << static_cast<unsigned char>(c);
-	return oss.str();
+	// whitespace separated hex codes, up to the first invalid one
+	std::string out;
+	std::size_t i = 0;
+	while (i < hexline.size()) {
+		if (std::isspace(static_cast<unsigned char>(hexline[i]))) {
+			++i;
+			continue;
+		}
+		std::size_t j = i;
+		while (j < hexline.size() && !std::isspace(static_cast<unsigned char>(hexline[j])))
+			++j;
+
+		const std::size_t pos = out.size();
+		out.resize(pos + (j - i) / 2);
+		const std::size_t bad = HexCodec::decode(hexline.data() + i, j - i,
+			reinterpret_cast<unsigned char *>(&out[pos]));
+		if (bad != HexCodec::npos || (j - i) % 2) {
+			out.resize(pos + (bad == HexCodec::npos ? (j - i) / 2 : bad / 2));
+			break;
+		}
+		i = j;
+	}
+	return out;
 }
 
 template<class Container>
 std::string HexDump<Container>::fromhexlines(const Lines &hexlines)
 {
-	std::ostringstream oss;
+	std::string out;
 	for (const auto &line : hexlines)
-		oss << fromhex(line);
-	return oss.str();
+		out += fromhex(line);
+	return out;
 }
 
 template <class Container>
@@ -202,17 +389,3 @@ std::string HexDump<Container>::lines_to_string(const Lines &addrlines, const Li
 	}
 	return oss.str();
 }
-
-template <class Container>
-std::string HexDump<Container>::char_to_hex(const unsigned char c)
-{
-	std::ostringstream oss;
-	oss << std::setw(2) << std::setfill('0') << std::hex << static_cast<unsigned int>(c);
-	return oss.str();
-}
-
-template <class Container>
-char HexDump<Container>::char_to_print(const unsigned char c)
-{
-	return std::isprint(c) ? c : '.';
-}
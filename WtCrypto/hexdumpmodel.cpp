@@ -23,3 +23,5 @@
 
 const int HexDumpTableModel::PT;
 const int HexDumpTableModel::CT;
+const std::size_t HexDumpTableModel::CACHED_ROWS;
+const std::size_t HexDumpTableModel::npos;
@@ -25,17 +25,30 @@
 #include <Wt/WModelIndex.h>
 #include <Wt/WAbstractTableModel.h>
 #include <Wt/WAny.h>
+#include <algorithm>
+#include <list>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#include "bytesearch.h"
 #include "hexdump.h"
 #include "encdecmodel.h"
 
+// Rows are formatted on demand from the bytes passed to rescan(),
+// which the model only refers to. The most recently rendered rows
+// are kept in a small LRU cache, as views ask for each cell in turn.
+// With a search pattern set, the bytes of its matches are
+// highlighted (CSS class hd-match) as rows are formatted.
 class HexDumpTableModel : public Wt::WAbstractTableModel
 {
 public:
 	constexpr static int PT = 0;
 	constexpr static int CT = 1;
 
+	constexpr static std::size_t CACHED_ROWS = 256;
+	constexpr static std::size_t npos = ByteSearch::npos;
+
 	HexDumpTableModel(const std::shared_ptr<EncDecModel> &ed_model, const int ptct = PT) :
 		Wt::WAbstractTableModel(),
 		ed_model_(ed_model),
@@ -45,9 +58,18 @@ public:
 		dumper_ = HexDump<std::vector<std::string>>();
 	}
 
+	// Read-only: shows bytes that don't belong to an EncDecModel,
+	// e.g. a window of a file.
+	HexDumpTableModel() :
+		Wt::WAbstractTableModel(),
+		ptct_(PT)
+	{
+		dumper_ = HexDump<std::vector<std::string>>();
+	}
+
 	int rowCount(const Wt::WModelIndex &parent = Wt::WModelIndex()) const override {
 		if (!parent.isValid())
-			return static_cast<int>(addr_.size());
+			return static_cast<int>(rows_);
 		else
 			return 0;
 	}
@@ -64,18 +86,18 @@ public:
 		case Wt::ItemDataRole::Display:
 			switch (index.column()) {
 			case 0:
-				return Wt::WString(addr_[index.row()]);
+				return row(index.row()).addr;
 			case 1:
-				return Wt::WString(hex_[index.row()]);
+				return row(index.row()).hex;
 			case 2:
-				return Wt::WString(print_[index.row()]);
+				return row(index.row()).print;
 			default:
 				return Wt::WString("Index(x,y) = {1},{2} out of bounds").arg(index.row()).arg(index.column());
 			}
 
 		case Wt::ItemDataRole::Edit:
-			if (index.column() == 1)
-				return Wt::WString(hex_[index.row()]); // prefill for edit
+			if (index.column() == 1) // prefill for edit, without markup
+				return row(index.row()).marked ? render(index.row(), false).hex : row(index.row()).hex;
 			else
 				return Wt::cpp17::any();
 
@@ -85,7 +107,9 @@ public:
 	}
 
 	bool setData(const Wt::WModelIndex& index, const Wt::cpp17::any &value, Wt::ItemDataRole role = Wt::ItemDataRole::Edit) override {
-		std::string value_str, str_to_print;
+		std::string value_str;
+		std::vector<std::string> lines;
+		std::size_t pos = 0, eol;
 
 		switch (role.value()) {
 		case Wt::ItemDataRole::Edit:
@@ -94,41 +118,47 @@ public:
 			value_str = Wt::asString(value).narrow();
 			// NYI: validate and reformat value_str
 
-			// convert string w/ hex codes to _printable_ string
-			str_to_print = dumper_.toprintline(dumper_.fromhex(value_str));
-
-			// update model
-			hex_[index.row()] = value_str;
-			print_[index.row()] = str_to_print;
-
-			// update associated plaintext/ciphertext view
-			// by updating the underlying EncDecModel, which
-			// will signal those views to update themselves.
-			switch (ptct_) {
-			case PT:
-				ed_model_->setPlaintext(Crypto::toBytes(dumper_.fromhexlines(hex_)));
-				break;
-			case CT:
-				ed_model_->setCiphertext(Crypto::toBytes(dumper_.fromhexlines(hex_)));
-				break;
-			default:
-				// NOTREACHED
-				break;
+			// several lines pasted at once replace as many rows
+			while ((eol = value_str.find('\n', pos)) != std::string::npos) {
+				lines.push_back(value_str.substr(pos, eol - pos));
+				pos = eol + 1;
 			}
+			if (pos != value_str.size() || lines.empty())
+				lines.push_back(value_str.substr(pos));
 
-			// selectively signal views about changed AREA
-			// by emitting dataChanged():
-			// dataChanged().emit(index, index with column()+1);
+			return setRows(index.row(), lines);
 
-			// easier than dataChanged():
-			// signal interested views that the _whole_ model was updated
-			reset();
+		default:
+			return false;
+		}
+	}
 
-			return true;
+	// Replace rows [first, first + hexlines.size()) by the bytes in
+	// hexlines, as one patch of the underlying EncDecModel.
+	bool setRows(const int first, const std::vector<std::string> &hexlines) {
+		if (ed_model_ == nullptr || bytes_ == nullptr || first < 0 || static_cast<std::size_t>(first) >= rows_)
+			return false;
 
+		const std::size_t bpl = dumper_.bytes_per_line();
+		const std::size_t offset = static_cast<std::size_t>(first) * bpl;
+		const std::size_t count = std::min(hexlines.size() * bpl, bytes_->size() - offset);
+		const auto replacement = Crypto::toBytes(dumper_.fromhexlines(hexlines));
+
+		// The EncDecModel signals the patch to the plaintext/ciphertext
+		// views, and to this model's patched().
+		switch (ptct_) {
+		case PT:
+			ed_model_->patchPlaintext(offset, count, replacement);
+			break;
+		case CT:
+			ed_model_->patchCiphertext(offset, count, replacement);
+			break;
 		default:
-			return false;
+			// NOTREACHED
+			break;
 		}
+
+		return true;
 	}
 
 	Wt::WFlags<Wt::ItemFlag> flags(const Wt::WModelIndex &index) const override {
@@ -136,29 +166,279 @@ public:
 		case 0:
 			return Wt::ItemFlag::Selectable; // addr non-editable
 		case 1:
-			return Wt::ItemFlag::Editable; // hex IS editable
+			if (ed_model_ == nullptr)
+				return Wt::ItemFlag::Selectable | markup(index);
+			return Wt::ItemFlag::Editable | markup(index); // hex IS editable
 		case 2:
-			return Wt::ItemFlag::Selectable; // print non-editable
+			return Wt::ItemFlag::Selectable | markup(index); // print non-editable
 		default:
 			return Wt::ItemFlag::Selectable; // NOTREACHED
 		}
 	}
 
-	void rescan(const Crypto::Bytes &input) {
-		auto instr = Crypto::toString(input);
-
-		addr_ = dumper_.toaddr(instr);
-		hex_ = dumper_.tohex(instr);
-		print_ = dumper_.toprint(instr);
+	// Show input, which must stay alive (and in place) until the next
+	// rescan(). Nothing is formatted until the views ask for rows.
+	// Addresses start at base, for windows into something larger.
+	void rescan(const Crypto::Bytes &input, const std::size_t base = 0) {
+		Metrics::Timer timer(Metrics::HEXDUMP_RESCAN);
+		bytes_ = &input;
+		base_ = base;
+		rows_ = rows();
+		next_ = 0;
+		matches_ = npos;
+		cache_.clear();
+		cache_index_.clear();
 
 		reset(); // send modelReset() signal to all attached views.
 	}
 
+	// The input was patched in place: count bytes at offset were
+	// replaced by inserted bytes. Only the rows from there on are
+	// reformatted, and only when the views ask for them again.
+	void patched(const std::size_t offset, const std::size_t count, const std::size_t inserted) {
+		assert(bytes_ != nullptr);
+
+		// a match may start up to search_.size() - 1 bytes earlier
+		const std::size_t bpl = dumper_.bytes_per_line();
+		const std::size_t reach = search_.empty() ? 0 : std::min(offset, search_.size() - 1);
+		const std::size_t first = (offset - reach) / bpl;
+		const std::size_t old_rows = rows_;
+		const std::size_t new_rows = rows();
+
+		// Appended: only matches that reach into the new bytes are new.
+		// Anything else may have made or broken matches anywhere.
+		if (matches_ != npos) {
+			if (count == 0 && offset + inserted == bytes_->size())
+				matches_ += search_.find_all(bytes_->data(), bytes_->size(), offset - reach,
+					[](std::size_t) { return true; });
+			else
+				matches_ = npos;
+		}
+
+		// Same length: the bytes after the patch stay where they were,
+		// but a match made or broken by it may end search_.size() - 1
+		// bytes later, in the next row.
+		const std::size_t reach_fwd = search_.empty() ? 0 : search_.size() - 1;
+		std::size_t end = count == inserted ? (offset + inserted + reach_fwd + bpl - 1) / bpl : new_rows;
+		end = std::min(end, std::min(old_rows, new_rows));
+
+		uncache(first, count == inserted ? end : old_rows);
+
+		if (new_rows > old_rows) {
+			beginInsertRows(Wt::WModelIndex(), static_cast<int>(old_rows), static_cast<int>(new_rows) - 1);
+			rows_ = new_rows;
+			endInsertRows();
+		}
+		else if (new_rows < old_rows) {
+			beginRemoveRows(Wt::WModelIndex(), static_cast<int>(new_rows), static_cast<int>(old_rows) - 1);
+			rows_ = new_rows;
+			endRemoveRows();
+		}
+
+		if (first < end)
+			dataChanged().emit(index(static_cast<int>(first), 0),
+				index(static_cast<int>(end) - 1, columnCount() - 1));
+	}
+
+	// Highlight the matches of pattern (nothing if empty), and start
+	// findNext() over from the first byte.
+	void setPattern(const Crypto::Bytes &pattern) {
+		const bool had = !search_.empty();
+		pattern_ = pattern;
+		search_ = ByteSearch(pattern_);
+		next_ = 0;
+		matches_ = npos;
+		if (!had && search_.empty())
+			return;
+		cache_.clear();
+		cache_index_.clear();
+		if (rows_ != 0)
+			dataChanged().emit(index(0, 0), index(static_cast<int>(rows_) - 1, columnCount() - 1));
+	}
+
+	const Crypto::Bytes &pattern() const { return pattern_; }
+
+	// Offset of the first match after the one findNext() returned last,
+	// wrapping around at the end; npos if there is none.
+	std::size_t findNext() {
+		if (bytes_ == nullptr)
+			return npos;
+		std::size_t at = search_.find(bytes_->data(), bytes_->size(), next_);
+		if (at == npos && next_ != 0)
+			at = search_.find(bytes_->data(), bytes_->size());
+		next_ = at == npos ? 0 : at + 1;
+		return at;
+	}
+
+	// Call f(offset) for each match, in order, until it returns false.
+	// Returns the number of calls.
+	template <class F>
+	std::size_t findAll(F f) const {
+		return bytes_ == nullptr ? 0 : search_.find_all(bytes_->data(), bytes_->size(), 0, f);
+	}
+
+	// The number of matches, as findAll() would return it: counted on
+	// first use after a rescan() or setPattern(), then kept up to date
+	// as the bytes grow at the end, e.g. while a ciphertext comes in.
+	std::size_t matchCount() const {
+		if (matches_ == npos)
+			matches_ = findAll([](std::size_t) { return true; });
+		return matches_;
+	}
+
+	// the row showing the byte at offset, e.g. for WTableView::scrollTo()
+	int rowOf(const std::size_t offset) const {
+		return static_cast<int>(offset / dumper_.bytes_per_line());
+	}
+
+	// the address shown for the byte at offset
+	std::size_t address(const std::size_t offset) const { return base_ + offset; }
+
 private:
+	struct Row {
+		Wt::WString addr;
+		Wt::WString hex;
+		Wt::WString print;
+		bool marked = false; // hex and print are XHTML
+	};
+
+	std::size_t rows() const {
+		if (bytes_ == nullptr)
+			return 0;
+		const std::size_t bpl = dumper_.bytes_per_line();
+		return (bytes_->size() + bpl - 1) / bpl;
+	}
+
+	// Row r, from the cache or freshly formatted
+	const Row &row(const int r) const {
+		auto it = cache_index_.find(r);
+		if (it != cache_index_.end()) {
+			cache_.splice(cache_.begin(), cache_, it->second); // most recent first
+			return it->second->second;
+		}
+
+		if (cache_.size() >= CACHED_ROWS) {
+			cache_index_.erase(cache_.back().first);
+			cache_.pop_back();
+		}
+		cache_.emplace_front(r, render(r));
+		cache_index_[r] = cache_.begin();
+		return cache_.front().second;
+	}
+
+	Row render(const int r, const bool mark = true) const {
+		const std::size_t bpl = dumper_.bytes_per_line();
+		const std::size_t addr = static_cast<std::size_t>(r) * bpl;
+		assert(bytes_ != nullptr && addr < bytes_->size());
+		const unsigned char *in = bytes_->data() + addr;
+		const std::size_t n = std::min(bpl, bytes_->size() - addr);
+
+		Metrics::rendered(1);
+
+		Row result;
+		std::string line(dumper_.addr_size(base_ + addr), '0');
+		dumper_.format_addr(base_ + addr, &line[0]);
+		result.addr = Wt::WString(line);
+
+		std::string hex(dumper_.hex_size(), ' ');
+		dumper_.format_hex(in, n, &hex[0]);
+
+		line.assign(n, ' ');
+		dumper_.format_print(in, n, &line[0]);
+
+		std::vector<bool> matched;
+		if (mark && !search_.empty())
+			matched = matches(addr, n);
+		if (matched.empty()) {
+			result.hex = Wt::WString(hex);
+			result.print = Wt::WString(line);
+			return result;
+		}
+
+		// wrap each run of matched bytes in a span, in both columns
+		const char *begin = "<span class=\"hd-match\">", *end = "</span>";
+		std::string hex_marked, print_marked;
+		std::size_t done = 0;
+		for (std::size_t i = 0; i != n; ++i) {
+			const std::size_t pos = dumper_.hex_pos(i);
+			if (matched[i] && (i == 0 || !matched[i - 1])) {
+				hex_marked.append(hex, done, pos - done);
+				hex_marked += begin;
+				print_marked += begin;
+				done = pos;
+			}
+			switch (line[i]) {
+			case '<': print_marked += "&lt;"; break;
+			case '>': print_marked += "&gt;"; break;
+			case '&': print_marked += "&amp;"; break;
+			default:  print_marked += line[i]; break;
+			}
+			if (matched[i] && (i + 1 == n || !matched[i + 1])) {
+				hex_marked.append(hex, done, pos + 2 - done);
+				hex_marked += end;
+				print_marked += end;
+				done = pos + 2;
+			}
+		}
+		hex_marked.append(hex, done, std::string::npos);
+
+		result.hex = Wt::WString(hex_marked);
+		result.print = Wt::WString(print_marked);
+		result.marked = true;
+		return result;
+	}
+
+	// rows with matches hold markup
+	Wt::WFlags<Wt::ItemFlag> markup(const Wt::WModelIndex &index) const {
+		if (!search_.empty() && row(index.row()).marked)
+			return Wt::ItemFlag::XHTMLText;
+		return Wt::WFlags<Wt::ItemFlag>();
+	}
+
+	// Which of the bytes [addr, addr + n) are part of a match; empty if
+	// none are. Only matches overlapping them are looked for.
+	std::vector<bool> matches(const std::size_t addr, const std::size_t n) const {
+		const std::size_t m = search_.size();
+		const std::size_t first = addr < m - 1 ? 0 : addr - (m - 1);
+		const std::size_t last = std::min(bytes_->size(), addr + n + m - 1);
+		std::vector<bool> matched;
+		search_.find_all(bytes_->data() + first, last - first, 0, [&](const std::size_t at) {
+			if (matched.empty())
+				matched.resize(n);
+			const std::size_t from = std::max(first + at, addr);
+			const std::size_t to = std::min(first + at + m, addr + n);
+			for (std::size_t i = from; i < to; ++i)
+				matched[i - addr] = true;
+			return true;
+		});
+		return matched;
+	}
+
+	// Drop cached rows [first, end)
+	void uncache(const std::size_t first, const std::size_t end) {
+		for (auto it = cache_.begin(); it != cache_.end(); ) {
+			const std::size_t r = static_cast<std::size_t>(it->first);
+			if (r >= first && r < end) {
+				cache_index_.erase(it->first);
+				it = cache_.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+
+	using CacheList = std::list<std::pair<int, Row>>;
+
 	HexDump<std::vector<std::string>> dumper_;
-	std::vector<std::string> addr_;
-	std::vector<std::string> hex_;
-	std::vector<std::string> print_;
-	std::shared_ptr<EncDecModel> ed_model_;
+	const Crypto::Bytes *bytes_ = nullptr; // owned by ed_model_
+	std::size_t base_ = 0; // address of (*bytes_)[0]
+	std::size_t rows_ = 0; // as last reported to the views
+	mutable CacheList cache_;
+	mutable std::unordered_map<int, CacheList::iterator> cache_index_;
+	Crypto::Bytes pattern_;
+	ByteSearch search_;    // of pattern_
+	std::size_t next_ = 0; // where findNext() goes on
+	mutable std::size_t matches_ = npos; // see matchCount(); npos: not counted
+	std::shared_ptr<EncDecModel> ed_model_; // nullptr: read-only
 	int ptct_;
 };
\ No newline at end of file
@@ -19,11 +19,33 @@
 // TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
 // PERFORMANCE OF THIS SOFTWARE.
 
+#include <iostream>
+
+#include <Wt/WServer.h>
+
+#include "cryptoruntime.h"
 #include "encdecapplication.h"
+#include "metricsresource.h"
 
 int main(int argc, char **argv)
 {
-	return Wt::WRun(argc, argv, [](const Wt::WEnvironment &env) {
-		return std::make_unique<EncDecApplication>(env);
-	});
-}
\ No newline at end of file
+	// initialize OpenSSL once, before the server starts its threads
+	CryptoRuntime crypto_runtime;
+
+	// outlives the server, which only refers to it
+	MetricsResource metrics;
+
+	try {
+		Wt::WServer server(argc, argv, WTHTTP_CONFIGURATION);
+		server.addEntryPoint(Wt::EntryPointType::Application, [](const Wt::WEnvironment &env) {
+			return std::make_unique<EncDecApplication>(env);
+		});
+		server.addResource(&metrics, "/metrics");
+		server.run();
+	}
+	catch (Wt::WServer::Exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
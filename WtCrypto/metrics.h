@@ -0,0 +1,422 @@
+// metrics.h -- Counters and latency histograms, in Prometheus text format
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <locale>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+
+/*
+* Counters and latency histograms of the hot paths, for scraping by
+* Prometheus (see MetricsResource). Every thread records into a shard
+* of its own, with relaxed loads and stores and no read-modify-write,
+* let alone locks; a scrape adds up the shards of all threads. Shards
+* are never freed: a thread's shard goes on a free list when it ends,
+* counts and all, and the next new thread carries on with it. There
+* are never more shards than threads ever alive at the same time.
+*
+* Recording compiles to nothing unless WTCRYPTO_METRICS is defined,
+* so that the command line tool and the benchmarks don't pay for it.
+*/
+class Metrics
+{
+	struct Histogram;
+	struct Shard;
+
+public:
+#ifdef WTCRYPTO_METRICS
+	constexpr static bool ENABLED = true;
+#else
+	constexpr static bool ENABLED = false;
+#endif
+
+	enum Op { ENCRYPT, DECRYPT, OPS };
+
+	// timed events other than encryption
+	enum Event {
+		SESSION_CREATE,
+		HEXDUMP_RESCAN,
+		// EncDecModel signals, timing all slots they run
+		CIPHER_CHANGED,
+		KEY_CHANGED,
+		IV_CHANGED,
+		KEYIV_CHANGED,
+		PLAINTEXT_CHANGED,
+		CIPHERTEXT_CHANGED,
+		TAG_CHANGED,
+		PLAINTEXT_PATCHED,
+		CIPHERTEXT_PATCHED,
+		ENCRYPT_PROGRESS,
+		EVENTS
+	};
+
+	// payload size buckets: up to 256 bytes, 4 KiB, 64 KiB, 1 MiB, 16 MiB, more
+	constexpr static std::size_t SIZES = 6;
+
+	// latency buckets: up to 1 us, 4 us, 16 us, ... 4^11 us (4.2 s), more
+	constexpr static std::size_t LATENCIES = 13;
+
+	// ciphers told apart; slot 0 counts all others
+	constexpr static std::size_t CIPHERS = 64;
+
+	// Times a call of Crypto::encrypt() / decrypt() or the like, on
+	// bytes of payload, which count as in flight meanwhile.
+	class CryptoTimer
+	{
+	public:
+		CryptoTimer(const EVP_CIPHER *cipher, const Op op, const std::size_t bytes) : bytes_(bytes) {
+			if (!ENABLED)
+				return;
+			shard_ = &shard();
+			histogram_ = &shard_->crypto[cipher_slot(cipher)][op][size_bucket(bytes)];
+			add(shard_->bytes_in_flight, static_cast<std::int64_t>(bytes));
+			start_ = std::chrono::steady_clock::now();
+		}
+
+		~CryptoTimer() {
+			if (!ENABLED)
+				return;
+			record(*histogram_, start_, bytes_);
+			add(shard_->bytes_in_flight, -static_cast<std::int64_t>(bytes_));
+		}
+
+		CryptoTimer(const CryptoTimer &) = delete;
+		CryptoTimer &operator=(const CryptoTimer &) = delete;
+
+	private:
+		Shard *shard_ = nullptr;
+		Histogram *histogram_ = nullptr;
+		std::chrono::steady_clock::time_point start_;
+		const std::size_t bytes_;
+	};
+
+	// Times the scope it lives in as an event.
+	class Timer
+	{
+	public:
+		explicit Timer(const Event event) : event_(event) {
+			if (ENABLED)
+				start_ = std::chrono::steady_clock::now();
+		}
+
+		~Timer() {
+			if (ENABLED)
+				record(shard().events[event_], start_, 0);
+		}
+
+		Timer(const Timer &) = delete;
+		Timer &operator=(const Timer &) = delete;
+
+	private:
+		const Event event_;
+		std::chrono::steady_clock::time_point start_;
+	};
+
+	// a session started (+1) or ended (-1)
+	static void session(const int delta) {
+		if (ENABLED)
+			add(shard().sessions_active, delta);
+	}
+
+	// hexdump rows formatted for the views
+	static void rendered(const std::size_t rows) {
+		if (ENABLED)
+			add(shard().rows_rendered, rows);
+	}
+
+	// everything recorded so far, in Prometheus' text format 0.0.4
+	static std::string prometheus() {
+		std::vector<Sum> crypto(CIPHERS * OPS * SIZES);
+		std::vector<Sum> events(EVENTS);
+		std::uint64_t rows_rendered = 0;
+		std::int64_t sessions_active = 0, bytes_in_flight = 0;
+
+		for (const Shard *s = state().shards.load(std::memory_order_acquire); s != nullptr; s = s->next) {
+			for (std::size_t c = 0; c < CIPHERS; ++c)
+				for (std::size_t op = 0; op < OPS; ++op)
+					for (std::size_t size = 0; size < SIZES; ++size)
+						crypto[(c * OPS + op) * SIZES + size] += s->crypto[c][op][size];
+			for (std::size_t e = 0; e < EVENTS; ++e)
+				events[e] += s->events[e];
+			rows_rendered += s->rows_rendered.load(std::memory_order_relaxed);
+			sessions_active += s->sessions_active.load(std::memory_order_relaxed);
+			bytes_in_flight += s->bytes_in_flight.load(std::memory_order_relaxed);
+		}
+
+		std::ostringstream out;
+		out.imbue(std::locale::classic());
+		out.precision(9);
+
+		static const char *const op_names[OPS] = { "encrypt", "decrypt" };
+		static const char *const size_names[SIZES] = { "256", "4096", "65536", "1048576", "16777216", "+Inf" };
+
+		header(out, "wtcrypto_crypto_seconds", "histogram",
+			"Time spent encrypting / decrypting, by cipher, operation and payload size.");
+		for (std::size_t c = 0; c < CIPHERS; ++c)
+			for (std::size_t op = 0; op < OPS; ++op)
+				for (std::size_t size = 0; size < SIZES; ++size) {
+					const Sum &sum = crypto[(c * OPS + op) * SIZES + size];
+					if (sum.count() != 0)
+						histogram(out, "wtcrypto_crypto_seconds", "cipher=\"" + cipher_name(c) +
+							"\",op=\"" + op_names[op] + "\",size=\"" + size_names[size] + "\"", sum);
+				}
+
+		header(out, "wtcrypto_crypto_bytes_total", "counter",
+			"Payload bytes encrypted / decrypted, by cipher, operation and payload size.");
+		for (std::size_t c = 0; c < CIPHERS; ++c)
+			for (std::size_t op = 0; op < OPS; ++op)
+				for (std::size_t size = 0; size < SIZES; ++size) {
+					const Sum &sum = crypto[(c * OPS + op) * SIZES + size];
+					if (sum.count() != 0)
+						out << "wtcrypto_crypto_bytes_total{cipher=\"" << cipher_name(c) << "\",op=\""
+							<< op_names[op] << "\",size=\"" << size_names[size] << "\"} " << sum.bytes << '\n';
+				}
+
+		header(out, "wtcrypto_session_create_seconds", "histogram",
+			"Time spent creating sessions.");
+		histogram(out, "wtcrypto_session_create_seconds", "", events[SESSION_CREATE]);
+
+		header(out, "wtcrypto_hexdump_rescan_seconds", "histogram",
+			"Time spent in HexDumpTableModel::rescan(), views' reactions included.");
+		histogram(out, "wtcrypto_hexdump_rescan_seconds", "", events[HEXDUMP_RESCAN]);
+
+		header(out, "wtcrypto_signal_seconds", "histogram",
+			"Time spent emitting EncDecModel signals, by signal.");
+		static const char *const signal_names[EVENTS] = {
+			nullptr, nullptr,
+			"cipherChanged", "keyChanged", "ivChanged", "keyivChanged",
+			"plaintextChanged", "ciphertextChanged", "tagChanged",
+			"plaintextPatched", "ciphertextPatched", "encryptProgress"
+		};
+		for (std::size_t e = CIPHER_CHANGED; e < EVENTS; ++e)
+			histogram(out, "wtcrypto_signal_seconds", std::string("signal=\"") + signal_names[e] + "\"", events[e]);
+
+		header(out, "wtcrypto_hexdump_rows_rendered_total", "counter",
+			"Hexdump rows formatted for the views.");
+		out << "wtcrypto_hexdump_rows_rendered_total " << rows_rendered << '\n';
+
+		header(out, "wtcrypto_sessions_active", "gauge",
+			"Sessions currently alive.");
+		out << "wtcrypto_sessions_active " << sessions_active << '\n';
+
+		header(out, "wtcrypto_bytes_in_flight", "gauge",
+			"Payload bytes currently being encrypted / decrypted.");
+		out << "wtcrypto_bytes_in_flight " << bytes_in_flight << '\n';
+
+		return out.str();
+	}
+
+private:
+	struct Histogram {
+		std::atomic<std::uint64_t> counts[LATENCIES];
+		std::atomic<std::uint64_t> nanoseconds;
+		std::atomic<std::uint64_t> bytes;
+	};
+
+	// a thread's share; written by that thread only
+	struct Shard {
+		Histogram crypto[CIPHERS][OPS][SIZES];
+		Histogram events[EVENTS];
+		std::atomic<std::uint64_t> rows_rendered;
+		std::atomic<std::int64_t> sessions_active;  // may go negative,
+		std::atomic<std::int64_t> bytes_in_flight;  // the sums don't
+		const Shard *next;
+		Shard *next_free; // on State::free, once its thread has ended
+	};
+
+	// a histogram's totals over all shards
+	struct Sum {
+		std::uint64_t counts[LATENCIES] = {};
+		std::uint64_t nanoseconds = 0;
+		std::uint64_t bytes = 0;
+
+		Sum &operator+=(const Histogram &h) {
+			for (std::size_t i = 0; i < LATENCIES; ++i)
+				counts[i] += h.counts[i].load(std::memory_order_relaxed);
+			nanoseconds += h.nanoseconds.load(std::memory_order_relaxed);
+			bytes += h.bytes.load(std::memory_order_relaxed);
+			return *this;
+		}
+
+		std::uint64_t count() const {
+			std::uint64_t n = 0;
+			for (std::size_t i = 0; i < LATENCIES; ++i)
+				n += counts[i];
+			return n;
+		}
+	};
+
+	// OpenSSL's NIDs are small integers
+	constexpr static int NIDS = 4096;
+
+	struct State {
+		std::atomic<const Shard *> shards{ nullptr };
+		std::atomic<unsigned char> slot_of_nid[NIDS]; // 0: not seen yet
+		std::atomic<int> nid_of_slot[CIPHERS];
+		std::size_t slots_used = 1;
+		std::mutex slots_mutex; // assigning slots only
+		Shard *free = nullptr; // of ended threads
+		std::mutex free_mutex; // threads starting and ending only
+	};
+
+	static State &state() {
+		static State s;
+		return s;
+	}
+
+	// The calling thread's shard, until it ends. Taking one over from
+	// the free list goes through its mutex, after the last writes of
+	// the thread before: single writer still.
+	class Owner
+	{
+	public:
+		Owner() {
+			State &st = state();
+			{
+				std::lock_guard<std::mutex> lock(st.free_mutex);
+				shard_ = st.free;
+				if (shard_ != nullptr)
+					st.free = shard_->next_free;
+			}
+			if (shard_ != nullptr)
+				return;
+
+			shard_ = new Shard(); // zeroed
+			const Shard *head = st.shards.load(std::memory_order_relaxed);
+			do
+				shard_->next = head;
+			while (!st.shards.compare_exchange_weak(head, shard_, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		~Owner() {
+			State &st = state();
+			std::lock_guard<std::mutex> lock(st.free_mutex);
+			shard_->next_free = st.free;
+			st.free = shard_;
+		}
+
+		Owner(const Owner &) = delete;
+		Owner &operator=(const Owner &) = delete;
+
+		Shard &shard() const { return *shard_; }
+
+	private:
+		Shard *shard_;
+	};
+
+	static Shard &shard() {
+		static thread_local Owner mine;
+		return mine.shard();
+	}
+
+	// single writer: no need for fetch_add()
+	template <typename T, typename D>
+	static void add(std::atomic<T> &a, const D delta) {
+		a.store(a.load(std::memory_order_relaxed) + static_cast<T>(delta), std::memory_order_relaxed);
+	}
+
+	static void record(Histogram &h, const std::chrono::steady_clock::time_point start, const std::size_t bytes) {
+		const auto ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count());
+		add(h.counts[latency_bucket(ns)], 1);
+		add(h.nanoseconds, ns);
+		add(h.bytes, bytes);
+	}
+
+	static std::size_t size_bucket(const std::size_t bytes) {
+		std::size_t i = 0;
+		while (i + 1 < SIZES && bytes > (std::uint64_t(256) << (4 * i)))
+			++i;
+		return i;
+	}
+
+	static std::size_t latency_bucket(const std::uint64_t ns) {
+		std::size_t i = 0;
+		while (i + 1 < LATENCIES && ns > (std::uint64_t(1000) << (2 * i)))
+			++i;
+		return i;
+	}
+
+	// A slot per cipher, in order of first use. Looking one up takes
+	// no lock, only the first use of a cipher does.
+	static std::size_t cipher_slot(const EVP_CIPHER *cipher) {
+		const int nid = cipher != nullptr ? EVP_CIPHER_nid(cipher) : 0;
+		if (nid <= 0 || nid >= NIDS)
+			return 0;
+		State &st = state();
+		std::size_t slot = st.slot_of_nid[nid].load(std::memory_order_acquire);
+		if (slot != 0)
+			return slot;
+
+		std::lock_guard<std::mutex> lock(st.slots_mutex);
+		slot = st.slot_of_nid[nid].load(std::memory_order_relaxed);
+		if (slot == 0 && st.slots_used < CIPHERS) {
+			slot = st.slots_used++;
+			st.nid_of_slot[slot].store(nid, std::memory_order_relaxed);
+			st.slot_of_nid[nid].store(static_cast<unsigned char>(slot), std::memory_order_release);
+		}
+		return slot;
+	}
+
+	// named as in CipherRegistry: "aes-128-cbc" is EVP_aes_128_cbc
+	static std::string cipher_name(const std::size_t slot) {
+		const int nid = slot != 0 ? state().nid_of_slot[slot].load(std::memory_order_relaxed) : 0;
+		const char *ln = nid != 0 ? OBJ_nid2ln(nid) : nullptr;
+		if (ln == nullptr)
+			return "other";
+		std::string name = std::string("EVP_") + ln;
+		std::replace(name.begin(), name.end(), '-', '_');
+		return name;
+	}
+
+	static void header(std::ostringstream &out, const char *name, const char *type, const char *help) {
+		out << "# HELP " << name << ' ' << help << '\n'
+			<< "# TYPE " << name << ' ' << type << '\n';
+	}
+
+	static void histogram(std::ostringstream &out, const char *name, const std::string &labels, const Sum &sum) {
+		const std::string sep = labels.empty() ? "" : ",";
+		std::uint64_t cumulative = 0;
+		for (std::size_t i = 0; i < LATENCIES; ++i) {
+			cumulative += sum.counts[i];
+			out << name << "_bucket{" << labels << sep << "le=\"";
+			if (i + 1 < LATENCIES)
+				out << static_cast<double>(std::uint64_t(1000) << (2 * i)) / 1e9;
+			else
+				out << "+Inf";
+			out << "\"} " << cumulative << '\n';
+		}
+		const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+		out << name << "_sum" << braces << ' ' << static_cast<double>(sum.nanoseconds) / 1e9 << '\n'
+			<< name << "_count" << braces << ' ' << cumulative << '\n';
+	}
+};
@@ -0,0 +1,48 @@
+// metricsresource.h -- Serves Metrics to Prometheus
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <Wt/WResource.h>
+#include <Wt/Http/Request.h>
+#include <Wt/Http/Response.h>
+
+#include "metrics.h"
+
+/*
+* The server's Metrics, for Prometheus to scrape. Not bound to any
+* session: main() adds it to the server as a static resource.
+*/
+class MetricsResource : public Wt::WResource
+{
+public:
+	~MetricsResource() {
+		beingDeleted();
+	}
+
+protected:
+	void handleRequest(const Wt::Http::Request &request, Wt::Http::Response &response) override {
+		(void)request;
+		response.setMimeType("text/plain; version=0.0.4; charset=utf-8");
+		response.out() << Metrics::prometheus();
+	}
+};
@@ -0,0 +1,132 @@
+// randompool.h -- Buffered, forward-secure random bytes for keys and IVs
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/opensslv.h>
+#include <openssl/rand.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+/*
+* Random bytes for keys and IVs, drawn from OpenSSL's DRBG BLOCK bytes
+* at a time into a buffer of the calling thread, so that a burst of new
+* sessions takes a fraction of the DRBG calls. Bytes are wiped from the
+* buffer as they are handed out: what's left in memory can't reveal
+* keys already made. The buffer is thrown away in the child of a
+* fork(), which would otherwise make the parent's keys again.
+*/
+class RandomPool
+{
+public:
+	constexpr static std::size_t BLOCK = 4096;
+
+	// n random bytes into out; throws std::runtime_error when the DRBG fails
+	static void fill(unsigned char *out, std::size_t n) {
+		if (n >= BLOCK) {
+			draw(out, n); // no point in buffering
+			return;
+		}
+
+		Buffer &b = buffer();
+		const unsigned generation = forks().load(std::memory_order_relaxed);
+		if (b.generation != generation) {
+			b.discard();
+			b.generation = generation;
+		}
+
+		while (n != 0) {
+			if (b.used == BLOCK) {
+				draw(b.bytes, BLOCK);
+				b.used = 0;
+			}
+			const std::size_t k = std::min(n, BLOCK - b.used);
+			std::memcpy(out, b.bytes + b.used, k);
+			OPENSSL_cleanse(b.bytes + b.used, k);
+			b.used += k;
+			out += k;
+			n -= k;
+		}
+	}
+
+private:
+	struct Buffer {
+		unsigned char bytes[BLOCK];
+		std::size_t used = BLOCK; // bytes[0, used) are spent
+		unsigned generation = 0;
+
+		~Buffer() {
+			discard();
+		}
+
+		void discard() {
+			OPENSSL_cleanse(bytes, BLOCK);
+			used = BLOCK;
+		}
+	};
+
+	static Buffer &buffer() {
+		static thread_local Buffer b;
+		return b;
+	}
+
+	// bumped in the child of every fork()
+	static std::atomic<unsigned> &forks() {
+		static std::atomic<unsigned> generation{ 0 };
+#if !defined(_WIN32)
+		static const int watching = pthread_atfork(nullptr, nullptr, [] {
+			forks().fetch_add(1, std::memory_order_relaxed);
+		});
+		(void)watching;
+#endif
+		return generation;
+	}
+
+	static void draw(unsigned char *out, std::size_t n) {
+		while (n != 0) {
+			const int k = static_cast<int>(std::min<std::size_t>(n, 1 << 30));
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+			const int ok = RAND_priv_bytes(out, k); // DRBG of its own, for secrets
+#else
+			const int ok = RAND_bytes(out, k);
+#endif
+			if (ok != 1) {
+				char buf[256];
+				ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+				throw std::runtime_error(std::string("Can't get random bytes: ") + buf);
+			}
+			out += k;
+			n -= static_cast<std::size_t>(k);
+		}
+	}
+};
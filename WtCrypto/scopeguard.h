@@ -25,16 +25,37 @@
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
+// Owns an EVP_CIPHER_CTX obtained from EVP_CIPHER_CTX_new() and
+// frees it when going out of scope. Movable, but not copyable.
 class ScopeGuard
 {
 public:
 	ScopeGuard(EVP_CIPHER_CTX *ctx = nullptr) : ctx_ptr_(ctx) {};
+	ScopeGuard(const ScopeGuard &) = delete;
+	ScopeGuard &operator=(const ScopeGuard &) = delete;
+	ScopeGuard(ScopeGuard &&other) noexcept : ctx_ptr_(other.ctx_ptr_) {
+		other.ctx_ptr_ = nullptr;
+	}
+	ScopeGuard &operator=(ScopeGuard &&other) noexcept {
+		if (this != &other) {
+			release();
+			ctx_ptr_ = other.ctx_ptr_;
+			other.ctx_ptr_ = nullptr;
+		}
+		return *this;
+	}
 	~ScopeGuard() {
+		release();
+	}
+
+	EVP_CIPHER_CTX *get() const { return ctx_ptr_; }
+
+private:
+	void release() {
 		if (ctx_ptr_)
-			EVP_CIPHER_CTX_cleanup(ctx_ptr_);
+			EVP_CIPHER_CTX_free(ctx_ptr_);
 		ctx_ptr_ = nullptr;
 	}
 
-private:
 	EVP_CIPHER_CTX * ctx_ptr_;
-};
\ No newline at end of file
+};
@@ -0,0 +1,115 @@
+// threadpool.h -- A fixed-size pool of worker threads
+// Copyright (C) 2018 Farid Hajji <farid@hajji.name>
+
+// ISC License
+// 
+// Copyright 2018 Farid Hajji <farid@hajji.name>
+// 
+// Permission to use, copy, modify, and/or distribute this software
+// for any purpose with or without fee is hereby granted, provided
+// that the above copyright notice and this permission notice appear
+// in all copies.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+// WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS.IN NO EVENT SHALL THE
+// AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+// DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+// OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+// TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+// PERFORMANCE OF THIS SOFTWARE.
+
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <vector>
+
+/*
+* A fixed number of worker threads executing submitted tasks in FIFO
+* order. submit() returns a future which becomes ready when the task
+* is done, and which rethrows any exception the task threw.
+*
+* Tasks must not block on other tasks of the same pool.
+*/
+class ThreadPool
+{
+public:
+	// nthreads == 0: one thread per hardware thread
+	explicit ThreadPool(std::size_t nthreads = 0) {
+		if (nthreads == 0)
+			nthreads = std::thread::hardware_concurrency();
+		if (nthreads == 0)
+			nthreads = 1;
+		for (std::size_t i = 0; i != nthreads; ++i)
+			workers_.emplace_back([this] { work(); });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		cv_.notify_all();
+		for (auto &worker : workers_)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	template <class F>
+	std::future<void> submit(F f) {
+		auto task = std::make_shared<std::packaged_task<void()>>(std::move(f));
+		auto result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			tasks_.emplace_back([task] { (*task)(); });
+		}
+		cv_.notify_one();
+		return result;
+	}
+
+	std::size_t size() const { return workers_.size(); }
+
+	// process-wide pool, shared by all sessions
+	static ThreadPool &instance() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	// process-wide pool for long jobs, such as a background encryption:
+	// apart from instance(), whose short tasks they would hold up
+	static ThreadPool &background() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+private:
+	void work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+				if (stop_ && tasks_.empty())
+					return;
+				task = std::move(tasks_.front());
+				tasks_.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<std::function<void()>> tasks_;
+	bool stop_ = false;
+	std::vector<std::thread> workers_;
+};